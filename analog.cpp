@@ -0,0 +1,122 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "analog.h"
+
+extern "C" {
+#include "osapi.h"
+}
+
+AnalogInput::AnalogInput(uint8_t pin, uint32_t interval, uint8_t filter) : pin(pin) {
+  this->interval = max(interval, (uint32_t)ANALOG_INTERVAL_MIN);
+  this->filter = min(filter, (uint8_t)ANALOG_FILTER_MAX);
+}
+
+AnalogInput::~AnalogInput() {
+  end();
+}
+
+/*
+ * Start sampling
+ */
+void AnalogInput::begin() {
+  lastSample = millis();
+  os_timer_setfn(&timer, timerCallback, this);
+  os_timer_arm(&timer, interval, true);
+}
+
+/*
+ * Stop sampling
+ */
+void AnalogInput::end() {
+  os_timer_disarm(&timer);
+}
+
+/*
+ * Timer trampoline
+ */
+void AnalogInput::timerCallback(void *arg) {
+  ((AnalogInput*)arg)->sample();
+}
+
+/*
+ * Take one oversampled reading and feed it to the filter
+ */
+void AnalogInput::sample() {
+  uint32_t start = micros();
+  int32_t sum = 0;
+  for (uint8_t i = 0; i < ANALOG_OVERSAMPLE; i++) {
+    sum += analogRead(pin);
+  }
+  sum = (sum >> ANALOG_DECIMATE) << ANALOG_FRACTION;
+  if (filtered < 0) {
+    filtered = sum;
+  } else {
+    filtered += (sum - filtered) >> filter;
+  }
+  if (millis() - lastSample > 2 * interval) {
+    late++;
+  }
+  lastSample = millis();
+  samples++;
+  fresh = true;
+  uint32_t runtime = micros() - start;
+  if (runtime > maxSampleTime) {
+    maxSampleTime = runtime;
+  }
+}
+
+/*
+ * Has a sample been taken since the last read()?
+ */
+bool AnalogInput::available() {
+  return fresh;
+}
+
+/*
+ * Filtered value (0 to ANALOG_MAX), marks the sample as read
+ */
+int32_t AnalogInput::read() {
+  fresh = false;
+  return getValue();
+}
+
+/*
+ * Filtered value (0 to ANALOG_MAX), -1 before the first sample
+ */
+int32_t AnalogInput::getValue() {
+  if (filtered < 0) {
+    return -1;
+  }
+  return (filtered + (1 << (ANALOG_FRACTION - 1))) >> ANALOG_FRACTION;
+}
+
+uint32_t AnalogInput::getInterval() {
+  return interval;
+}
+
+uint32_t AnalogInput::getSamples() {
+  return samples;
+}
+
+uint32_t AnalogInput::getLate() {
+  return late;
+}
+
+uint32_t AnalogInput::getMaxSampleTime() {
+  return maxSampleTime;
+}
@@ -0,0 +1,67 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ANALOG_H
+#define ANALOG_H
+
+#include <Arduino.h>
+
+extern "C" {
+#include "user_interface.h"
+}
+
+#define ANALOG_OVERSAMPLE       16          // ADC reads summed per sample, 4^n reads gain n bits
+#define ANALOG_DECIMATE         2           // Shift of the sum, decimating 10 bit reads to a 12 bit value
+#define ANALOG_MAX              ((1023 * ANALOG_OVERSAMPLE) >> ANALOG_DECIMATE)
+#define ANALOG_FRACTION         8           // Fractional bits of the filter state
+#define ANALOG_FILTER_MAX       8           // Slowest filter, new samples weigh 1/256
+#define ANALOG_INTERVAL_MIN     5           // Shortest sample interval (ms), reading the ADC more often disturbs WiFi
+
+/*
+ * Samples the ADC from a timer at a fixed rate, independent of how often loop() runs
+ * Every sample sums ANALOG_OVERSAMPLE reads, decimated to 12 bit, and goes through an exponential moving average, so the cost per sample is bounded
+ * Timer callbacks run when loop() yields, a long task delays samples, these are counted as late
+ */
+class AnalogInput {
+public:
+  AnalogInput(uint8_t pin, uint32_t interval, uint8_t filter);
+  ~AnalogInput();
+  void begin();
+  void end();
+  bool available();
+  int32_t read();
+  int32_t getValue();
+  uint32_t getInterval();
+  uint32_t getSamples();
+  uint32_t getLate();
+  uint32_t getMaxSampleTime();
+private:
+  static void timerCallback(void *arg);
+  void sample();
+  os_timer_t                timer;
+  uint8_t                   pin;                                  // ADC pin, A0 on the ESP8266
+  uint32_t                  interval;                             // Time between samples (ms)
+  uint8_t                   filter;                               // New samples weigh 1/2^filter
+  int32_t                   filtered = -1;                        // Filter state with ANALOG_FRACTION fractional bits, -1 before the first sample
+  uint32_t                  lastSample = 0;                       // Time (ms) of last sample
+  volatile bool             fresh = false;                        // Sample taken since last read()
+  uint32_t                  samples = 0;                          // Samples taken
+  uint32_t                  late = 0;                             // Samples taken more than an interval late
+  uint32_t                  maxSampleTime = 0;                    // Longest sample (us)
+};
+
+#endif // ANALOG_H
@@ -0,0 +1,54 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Generated by tools/assets.py from the files in www/, do not edit
+ */
+
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <Arduino.h>
+
+/*
+ * Gzip compressed static file in flash
+ */
+typedef struct {
+  const char                *path;                                // Request path
+  const char                *contentType;                         // MIME type
+  const char                *etag;                                // Strong ETag, quoted
+  const uint8_t             *data;                                // Gzip compressed content
+  uint16_t                  length;                               // Length of compressed content
+} staticAsset;
+
+const char assetStyleCssPath[] PROGMEM = "/style.css";
+const char assetStyleCssType[] PROGMEM = "text/css";
+const char assetStyleCssEtag[] PROGMEM = "\"31dd789a3f272b38\"";
+const uint8_t assetStyleCssData[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xcb, 0x49, 0x4c, 0x4a, 0xcd, 0xa9,
+  0x4e, 0xc9, 0x2c, 0x2e, 0xc8, 0x49, 0xac, 0xb4, 0xca, 0xcc, 0xcb, 0xc9, 0xcc, 0x4b, 0xd5, 0x4d,
+  0xca, 0xc9, 0x4f, 0xce, 0xb6, 0x2e, 0xcf, 0x4c, 0x29, 0xc9, 0xb0, 0x32, 0x36, 0x35, 0x28, 0xa8,
+  0xb0, 0xae, 0xe5, 0x02, 0x00, 0x1e, 0x78, 0x1e, 0xb2, 0x29, 0x00, 0x00, 0x00,
+};
+
+const staticAsset staticAssets[] = {
+  {assetStyleCssPath, assetStyleCssType, assetStyleCssEtag, assetStyleCssData, 61},
+};
+
+#define STATIC_ASSET_COUNT 1
+
+#endif // ASSETS_H
@@ -0,0 +1,256 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "benchmark.h"
+
+#ifdef SONNY_BENCHMARK
+
+#define BENCHMARK_INPUT_SIZE    512
+
+// Representative DSMR 5 telegram, line endings as sent by the meter
+static const char benchmarkTelegram[] PROGMEM =
+  "/ISK5\\2M550T-1012\r\n\r\n"
+  "1-3:0.2.8(50)\r\n"
+  "0-0:1.0.0(190101120000W)\r\n"
+  "0-0:96.1.1(4530303434303037313331363530363138)\r\n"
+  "1-0:1.8.1(001234.567*kWh)\r\n"
+  "1-0:1.8.2(002345.678*kWh)\r\n"
+  "1-0:2.8.1(000123.456*kWh)\r\n"
+  "1-0:2.8.2(000234.567*kWh)\r\n"
+  "0-0:96.14.0(0002)\r\n"
+  "1-0:1.7.0(00.456*kW)\r\n"
+  "1-0:2.7.0(00.000*kW)\r\n"
+  "0-0:96.7.21(00010)\r\n"
+  "0-0:96.7.9(00003)\r\n"
+  "1-0:32.32.0(00002)\r\n"
+  "1-0:32.36.0(00000)\r\n"
+  "0-0:96.13.0()\r\n"
+  "1-0:32.7.0(230.1*V)\r\n"
+  "1-0:31.7.0(002*A)\r\n"
+  "1-0:21.7.0(00.456*kW)\r\n"
+  "1-0:22.7.0(00.000*kW)\r\n"
+  "0-1:24.1.0(003)\r\n"
+  "0-1:96.1.0(4730303339303031373030363630353137)\r\n"
+  "0-1:24.2.1(190101115500W)(01234.567*m3)\r\n"
+  "!";
+
+// Remeha sample response of 64 bytes, STX, payload, CRC and ETX
+static const uint8_t benchmarkRemehaFrame[] PROGMEM = {
+  0x02, 0x01, 0xfe, 0x06, 0x48, 0x02, 0x01, 0x02, 0x00, 0x10, 0x0e, 0x1f, 0x0e, 0x00, 0x80, 0x07,
+  0x09, 0x30, 0x11, 0x64, 0x00, 0x38, 0x08, 0x00, 0x80, 0xe8, 0x03, 0x34, 0x08, 0x00, 0x00, 0x00,
+  0x00, 0x46, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3c, 0xa1, 0x03
+};
+
+const benchmarkCase Benchmark::cases[] = {
+  { "HtmlTable",            &Benchmark::htmlTable,          100 },
+  { "HtmlForm",             &Benchmark::htmlForm,           100 },
+  { "ioPayload",            &Benchmark::ioPayload,          500 },
+  { "Logger::format",       &Benchmark::loggerFormat,       500 },
+  { "restoreJournal",       &Benchmark::settingsJournal,    10 },
+  { "saveSettings",         &Benchmark::settingsSave,       10 },
+#ifdef SONNY_P1
+  { "p1CalculateCRC16",     &Benchmark::p1CRC,              100 },
+#endif
+#ifdef SONNY_REMEHA
+  { "remehaCalculateCRC",   &Benchmark::remehaCRC,          500 },
+#endif
+#if SONOFF_DEVICE == SONOFF_DUAL
+  { "SonnyDual::readAll",   &Benchmark::dualReadAll,        500 },
+#endif
+};
+
+BenchmarkStream::BenchmarkStream(const uint8_t *frame, uint8_t length) : frame(frame), length(length) {
+}
+
+/*
+ * Rest of current frame, a whole frame once it has been read
+ */
+int BenchmarkStream::available() {
+  return length - position;
+}
+
+int BenchmarkStream::read() {
+  uint8_t data = frame[position++];
+  if (position == length) {
+    position = 0;
+  }
+  return data;
+}
+
+int BenchmarkStream::peek() {
+  return frame[position];
+}
+
+size_t BenchmarkStream::write(uint8_t data) {
+  return 1;
+}
+
+Benchmark::Benchmark(Sonny *device, SettingsManager *settings) : device(device), settings(settings) {
+}
+
+/*
+ * Run all cases and write results, one line per case: name, iterations, ns/op, heap retained/op (bytes) and tracked allocations/op
+ */
+bool Benchmark::run(const char *path) {
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  // Not mounted yet when settings came from RTC memory
+  settings->mountFilesystem();
+  File results = SPIFFS.open(path, "w");
+  if (!results) {
+    return false;
+  }
+  input = (uint8_t *)malloc(BENCHMARK_INPUT_SIZE);
+  if (!input) {
+    results.close();
+    return false;
+  }
+  scratch = new SettingsManager(settings->filename, settings->logSerial);
+  for (uint8_t i = 0; i < settingLast; i++) {
+    sonoffSetting *setting = settings->getSetting(i);
+    scratch->addSetting((sonoffSettingIndex)i, (sonoffSettingType)setting->settingType, setting->visible, setting->settingName, setting->settingDescription, setting->settingLength);
+  }
+  results.printf("# %s %u MHz\n", ESP.getSketchMD5().c_str(), mhz);
+  for (uint8_t i = 0; i < sizeof(cases) / sizeof(benchmarkCase); i++) {
+    const benchmarkCase *benchmark = &cases[i];
+    // Warm up caches and lazily allocated buffers
+    (this->*benchmark->op)();
+    uint32_t heap = ESP.getFreeHeap();
+    uint32_t allocations = Heap::getAllocations();
+    uint32_t start = ESP.getCycleCount();
+    for (uint16_t iteration = 0; iteration < benchmark->iterations; iteration++) {
+      (this->*benchmark->op)();
+    }
+    uint32_t cycles = ESP.getCycleCount() - start;
+    int32_t retained = (int32_t)(heap - ESP.getFreeHeap());
+    results.printf("%s %u %u %d %u\n", benchmark->name, benchmark->iterations, (uint32_t)((uint64_t)cycles * 1000 / mhz / benchmark->iterations), retained / (int32_t)benchmark->iterations, (Heap::getAllocations() - allocations) / benchmark->iterations);
+    yield();
+  }
+  delete scratch;
+  free(input);
+  results.close();
+  return true;
+}
+
+/*
+ * Table like the one on /control
+ */
+void Benchmark::htmlTable() {
+  const __FlashStringHelper * headers[] = {
+    F("Task"), F("Period (ms)"), F("Runs"), F("Overruns"), F("Max runtime (us)")
+  };
+  HtmlTable table("benchmarkTable", 5, headers);
+  for (uint8_t i = 0; i < 8; i++) {
+    table.addRow({String("task"), String(i * 100, DEC), String(123456, DEC), String(i, DEC), String(2345, DEC)});
+  }
+  sink += table.toString().length();
+}
+
+/*
+ * Form like the one on /configure
+ */
+void Benchmark::htmlForm() {
+  HtmlForm form("benchmarkForm", F("configure"));
+  for (uint8_t i = 0; i < 8; i++) {
+    form.addTextField(F("mqtt_host"), F("MQTT broker hostname"), 32, String("192.168.0.2"), false);
+  }
+  sink += form.toString().length();
+}
+
+/*
+ * JSON of an input change
+ */
+void Benchmark::ioPayload() {
+  char payload[128];
+  sink += Sonny::ioPayload(payload, sizeof(payload), "bool", true, false, 12345);
+}
+
+/*
+ * Log line with a few arguments
+ */
+void Benchmark::loggerFormat() {
+  format(F("Remeha %s response timeout after %d ms\r\n"), "sample", 200);
+}
+
+void Benchmark::format(const __FlashStringHelper *format, ...) {
+  va_list args;
+  va_start(args, format);
+  char *line = Logger::format(Logger::severityWarning, format, args);
+  va_end(args);
+  sink += line[0];
+  Heap::release(line);
+}
+
+/*
+ * Read and replay the journal, into a scratch copy so pending changes of the device survive and nothing is written
+ */
+void Benchmark::settingsJournal() {
+  sink += scratch->restoreJournal(String(scratch->filename));
+}
+
+/*
+ * Nothing changed, measures the journal check
+ */
+void Benchmark::settingsSave() {
+  sink += settings->saveSettings(false);
+}
+
+#ifdef SONNY_P1
+/*
+ * Whole telegram, CRC of device is restored so a telegram being received is not affected
+ */
+void Benchmark::p1CRC() {
+  uint16_t length = min((size_t)BENCHMARK_INPUT_SIZE, sizeof(benchmarkTelegram) - 1);
+  uint16_t crc = device->p1CRC;
+  memcpy_P(input, benchmarkTelegram, length);
+  device->p1CRC = 0;
+  sink += device->p1CalculateCRC16(input, length);
+  device->p1CRC = crc;
+}
+#endif
+
+#ifdef SONNY_REMEHA
+/*
+ * Payload of a sample response
+ */
+void Benchmark::remehaCRC() {
+  memcpy_P(input, benchmarkRemehaFrame, sizeof(benchmarkRemehaFrame));
+  sink += Sonny::remehaCalculateCRC(input + 1, sizeof(benchmarkRemehaFrame) - 3);
+}
+#endif
+
+#if SONOFF_DEVICE == SONOFF_DUAL
+/*
+ * Relay status frame matching current outputs, so no state changes
+ */
+void Benchmark::dualReadAll() {
+  SonnyDual *dual = (SonnyDual *)device;
+  uint8_t frame[4] = { 0xa0, 0x04, 0x00, 0xa1 };
+  for (uint8_t i = 0; i < dual->outputCount; i++) {
+    if (dual->outputs[i]->currentState) {
+      frame[2] |= dual->inputs[i]->pin;
+    }
+  }
+  BenchmarkStream stream(frame, sizeof(frame));
+  Stream *link = dual->dualSerial;
+  dual->dualSerial = &stream;
+  dual->readAll();
+  dual->dualSerial = link;
+}
+#endif
+
+#endif // SONNY_BENCHMARK
@@ -0,0 +1,89 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "sonny.h"
+#include "html.h"
+
+#ifdef SONNY_BENCHMARK
+
+#define BENCHMARK_FILE          "/bench.txt"
+
+class Benchmark;
+
+/*
+ * Hot function exercised with fixed input
+ */
+typedef struct {
+  const char                *name;                                // Name in results
+  void                      (Benchmark::*op)();                   // One operation
+  uint16_t                  iterations;                           // Operations timed, keep total well below the watchdog
+} benchmarkCase;
+
+/*
+ * Serves the same Dual frame over and over
+ */
+class BenchmarkStream : public Stream {
+public:
+  BenchmarkStream(const uint8_t *frame, uint8_t length);
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t data);
+private:
+  const uint8_t             *frame;
+  uint8_t                   length;
+  uint8_t                   position = 0;
+};
+
+/*
+ * Times hot functions of the firmware on the device and writes ns/op, retained heap/op and allocations/op to a results file
+ */
+class Benchmark {
+public:
+  Benchmark(Sonny *device, SettingsManager *settings);
+  bool run(const char *path);
+private:
+  void htmlTable();
+  void htmlForm();
+  void ioPayload();
+  void loggerFormat();
+  void settingsJournal();
+  void settingsSave();
+#ifdef SONNY_P1
+  void p1CRC();
+#endif
+#ifdef SONNY_REMEHA
+  void remehaCRC();
+#endif
+#if SONOFF_DEVICE == SONOFF_DUAL
+  void dualReadAll();
+#endif
+  void format(const __FlashStringHelper *format, ...);
+  static const benchmarkCase cases[];
+  Sonny                     *device;
+  SettingsManager           *settings;
+  SettingsManager           *scratch;                             // Same settings as the device, restored from the journal without touching the device's values
+  uint8_t                   *input;                               // Fixed input for the CRC cases
+  volatile uint32_t         sink;                                 // Results go here so nothing is optimised away
+};
+
+#endif // SONNY_BENCHMARK
+
+#endif // BENCHMARK_H
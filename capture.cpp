@@ -0,0 +1,398 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "capture.h"
+
+/*
+ * Prepare for recording or replay, begin() opens the files
+ */
+Capture::Capture(uint8_t mode, uint16_t speed) : mode(mode), speed(speed) {
+  memset(bytes, 0x00, sizeof(bytes));
+}
+
+/*
+ * Release recording buffers
+ */
+Capture::~Capture() {
+  end();
+  free(buffers);
+}
+
+/*
+ * Open capture file for recording or check replay file, false when unusable. SPIFFS has to be mounted
+ */
+bool Capture::begin() {
+  captureHeader header;
+  start = millis();
+  if (mode == captureModeRecord) {
+    buffers = (captureBuffer*)malloc(sizeof(captureBuffer) * captureChannels * 2);
+    if (!buffers) {
+      return false;
+    }
+    memset(buffers, 0x00, sizeof(captureBuffer) * captureChannels * 2);
+    file = SPIFFS.open(CAPTURE_FILE, "w");
+    if (!file) {
+      return false;
+    }
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.reserved = 0;
+    size = file.write((const uint8_t *)&header, sizeof(header));
+    return (size == sizeof(header));
+  }
+  if (mode == captureModeReplay) {
+    file = SPIFFS.open(REPLAY_FILE, "r");
+    if (!file || (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) || (header.magic != CAPTURE_MAGIC) || (header.version != CAPTURE_VERSION)) {
+      return false;
+    }
+    file.close();
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Write whatever is buffered and close the capture, recording stops
+ */
+void Capture::end() {
+  if ((mode != captureModeRecord) || !file) {
+    return;
+  }
+  flush(true);
+  file.close();
+}
+
+/*
+ * Wrap connection, for MQTT
+ */
+Client *Capture::wrap(Client *client, uint8_t channel) {
+  if (mode == captureModeReplay) {
+    active |= (1 << channel);
+    return new CaptureReplay(this, channel);
+  }
+  return new CaptureRecorder(this, channel, client, client);
+}
+
+/*
+ * Wrap serial port
+ */
+Stream *Capture::wrap(Stream *stream, uint8_t channel) {
+  if (mode == captureModeReplay) {
+    active |= (1 << channel);
+    return new CaptureReplay(this, channel);
+  }
+  return new CaptureRecorder(this, channel, stream, NULL);
+}
+
+/*
+ * Buffer traffic, a record is written when the buffer is full
+ */
+void Capture::record(uint8_t channel, uint8_t direction, const uint8_t *data, size_t length) {
+  captureBuffer *buffer = &buffers[channel * 2 + direction];
+  if (!file) {
+    return;
+  }
+  bytes[channel] += length;
+  while (length) {
+    if (!buffer->length) {
+      buffer->time = millis() - start;
+    }
+    size_t chunk = min(length, (size_t)(CAPTURE_CHUNK - buffer->length));
+    memcpy(buffer->data + buffer->length, data, chunk);
+    buffer->length += chunk;
+    data += chunk;
+    length -= chunk;
+    if (buffer->length == CAPTURE_CHUNK) {
+      writeRecord(channel, direction);
+    }
+  }
+}
+
+/*
+ * Write buffers that have been waiting too long, or all of them
+ */
+void Capture::flush(bool all) {
+  uint32_t now = millis() - start;
+  if ((mode != captureModeRecord) || !file) {
+    return;
+  }
+  for (uint8_t i = 0; i < captureChannels * 2; i++) {
+    if (buffers[i].length && (all || (now - buffers[i].time >= CAPTURE_FLUSH_TIME))) {
+      writeRecord(i / 2, i % 2);
+    }
+  }
+}
+
+/*
+ * Append buffer of channel and direction as record, stop at CAPTURE_MAX_SIZE
+ */
+void Capture::writeRecord(uint8_t channel, uint8_t direction) {
+  captureBuffer *buffer = &buffers[channel * 2 + direction];
+  captureRecord record;
+  record.time = buffer->time;
+  record.channel = channel;
+  record.direction = direction;
+  record.length = buffer->length;
+  buffer->length = 0;
+  if (size + sizeof(record) + record.length > CAPTURE_MAX_SIZE) {
+    file.close();
+    return;
+  }
+  size += file.write((const uint8_t *)&record, sizeof(record));
+  size += file.write(buffer->data, record.length);
+}
+
+/*
+ * Skip to next received record of channel, false at end of file
+ */
+bool Capture::nextRecord(File &replay, uint8_t channel, captureRecord *record) {
+  while (replay.read((uint8_t *)record, sizeof(captureRecord)) == sizeof(captureRecord)) {
+    if ((record->channel == channel) && (record->direction == captureReceived)) {
+      return true;
+    }
+    replay.seek(replay.position() + record->length);
+  }
+  return false;
+}
+
+/*
+ * Has the time of the record come, taking replay speed into account?
+ */
+bool Capture::isDue(captureRecord *record) {
+  return (!speed || ((millis() - start) * speed >= record->time));
+}
+
+/*
+ * Account replayed bytes
+ */
+void Capture::countReplayed(uint8_t channel, size_t length) {
+  bytes[channel] += length;
+}
+
+/*
+ * Channel ran out of records, remember when the last one did
+ */
+void Capture::replayFinished(uint8_t channel) {
+  active &= ~(1 << channel);
+  if (!active) {
+    finish = millis();
+  }
+}
+
+/*
+ * Recording or replaying?
+ */
+uint8_t Capture::getMode() {
+  return mode;
+}
+
+/*
+ * Bytes written to capture file
+ */
+uint32_t Capture::getSize() {
+  return size;
+}
+
+/*
+ * Bytes recorded or replayed on channel
+ */
+uint32_t Capture::getBytes(uint8_t channel) {
+  return bytes[channel];
+}
+
+/*
+ * Time (ms) since start, or until replay finished
+ */
+uint32_t Capture::getDuration() {
+  return (finish ? finish : millis()) - start;
+}
+
+/*
+ * Have all replayed channels run out?
+ */
+bool Capture::isFinished() {
+  return (mode == captureModeReplay) && !active;
+}
+
+/*
+ * Recorder for a port (client NULL) or a connection (client same as stream)
+ */
+CaptureRecorder::CaptureRecorder(Capture *capture, uint8_t channel, Stream *stream, Client *client) : capture(capture), channel(channel), stream(stream), client(client) {
+}
+
+int CaptureRecorder::connect(IPAddress ip, uint16_t port) {
+  return (client ? client->connect(ip, port) : 0);
+}
+
+int CaptureRecorder::connect(const char *host, uint16_t port) {
+  return (client ? client->connect(host, port) : 0);
+}
+
+size_t CaptureRecorder::write(uint8_t data) {
+  size_t written = stream->write(data);
+  capture->record(channel, captureSent, &data, written);
+  return written;
+}
+
+size_t CaptureRecorder::write(const uint8_t *buffer, size_t size) {
+  size_t written = stream->write(buffer, size);
+  capture->record(channel, captureSent, buffer, written);
+  return written;
+}
+
+int CaptureRecorder::available() {
+  return stream->available();
+}
+
+int CaptureRecorder::read() {
+  int data = stream->read();
+  if (data >= 0) {
+    uint8_t byte = data;
+    capture->record(channel, captureReceived, &byte, 1);
+  }
+  return data;
+}
+
+int CaptureRecorder::read(uint8_t *buffer, size_t size) {
+  int length;
+  if (!client) {
+    length = stream->readBytes(buffer, size);
+  } else {
+    length = client->read(buffer, size);
+  }
+  if (length > 0) {
+    capture->record(channel, captureReceived, buffer, length);
+  }
+  return length;
+}
+
+int CaptureRecorder::peek() {
+  return stream->peek();
+}
+
+int CaptureRecorder::availableForWrite() {
+  return stream->availableForWrite();
+}
+
+void CaptureRecorder::flush() {
+  stream->flush();
+}
+
+void CaptureRecorder::stop() {
+  if (client) {
+    client->stop();
+  }
+}
+
+uint8_t CaptureRecorder::connected() {
+  return (client ? client->connected() : 1);
+}
+
+CaptureRecorder::operator bool() {
+  return (client ? (bool)*client : true);
+}
+
+/*
+ * Replay of a channel from its own handle on the replay file
+ */
+CaptureReplay::CaptureReplay(Capture *capture, uint8_t channel) : capture(capture), channel(channel) {
+  replay = SPIFFS.open(REPLAY_FILE, "r");
+  replay.seek(sizeof(captureHeader));
+}
+
+/*
+ * Make sure a record is being read, false when there is none or its time has not come yet
+ */
+bool CaptureReplay::load() {
+  if (finished) {
+    return false;
+  }
+  if (!remaining) {
+    if (!capture->nextRecord(replay, channel, &current)) {
+      finished = true;
+      replay.close();
+      capture->replayFinished(channel);
+      return false;
+    }
+    remaining = current.length;
+  }
+  return capture->isDue(&current);
+}
+
+int CaptureReplay::connect(IPAddress ip, uint16_t port) {
+  return 1;
+}
+
+int CaptureReplay::connect(const char *host, uint16_t port) {
+  return 1;
+}
+
+size_t CaptureReplay::write(uint8_t data) {
+  return 1;
+}
+
+size_t CaptureReplay::write(const uint8_t *buffer, size_t size) {
+  return size;
+}
+
+int CaptureReplay::available() {
+  return (load() ? remaining : 0);
+}
+
+int CaptureReplay::read() {
+  if (!load()) {
+    return -1;
+  }
+  remaining--;
+  capture->countReplayed(channel, 1);
+  return replay.read();
+}
+
+int CaptureReplay::read(uint8_t *buffer, size_t size) {
+  if (!load()) {
+    return 0;
+  }
+  size_t length = replay.read(buffer, min(size, (size_t)remaining));
+  remaining -= length;
+  capture->countReplayed(channel, length);
+  return length;
+}
+
+int CaptureReplay::peek() {
+  return (load() ? replay.peek() : -1);
+}
+
+/*
+ * Sent bytes are dropped, so there's always room
+ */
+int CaptureReplay::availableForWrite() {
+  return 0x7fff;
+}
+
+void CaptureReplay::flush() {
+}
+
+void CaptureReplay::stop() {
+}
+
+uint8_t CaptureReplay::connected() {
+  return 1;
+}
+
+CaptureReplay::operator bool() {
+  return true;
+}
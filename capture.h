@@ -0,0 +1,167 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <FS.h>
+
+#define CAPTURE_FILE            "/capture.bin"
+#define REPLAY_FILE             "/replay.bin"
+#define CAPTURE_MAGIC           0x50414353  // "SCAP"
+#define CAPTURE_VERSION         1
+#define CAPTURE_CHUNK           64          // Bytes buffered per channel and direction before writing a record
+#define CAPTURE_FLUSH_TIME      20          // Oldest buffered byte (ms) before a record is written anyway
+#define CAPTURE_MAX_SIZE        262144      // Recording stops at this file size
+
+typedef enum {
+  captureModeOff = 0,
+  captureModeRecord,
+  captureModeReplay
+} captureMode;
+
+typedef enum {
+  captureP1 = 0,
+  captureRemeha,
+  captureDual,
+  captureMqtt,
+  captureChannels
+} captureChannel;
+
+typedef enum {
+  captureReceived = 0,                      // Bytes read by the firmware
+  captureSent                               // Bytes written by the firmware
+} captureDirection;
+
+/*
+ * File starts with a header, followed by records of timestamped bytes
+ */
+typedef struct {
+  uint32_t                  magic;                                // CAPTURE_MAGIC
+  uint16_t                  version;                              // CAPTURE_VERSION
+  uint16_t                  reserved;
+} captureHeader;
+
+typedef struct {
+  uint32_t                  time;                                 // Time of first byte since start of recording (ms)
+  uint8_t                   channel;                              // captureChannel
+  uint8_t                   direction;                            // captureDirection
+  uint16_t                  length;                               // Amount of bytes following
+} captureRecord;
+
+/*
+ * Bytes of one channel and direction waiting to be written
+ */
+typedef struct {
+  uint32_t                  time;                                 // Time of first byte (ms)
+  uint16_t                  length;                               // Buffered bytes
+  uint8_t                   data[CAPTURE_CHUNK];
+} captureBuffer;
+
+/*
+ * Records serial and MQTT traffic to SPIFFS, or feeds a recording back in place of the real ports
+ */
+class Capture {
+public:
+  Capture(uint8_t mode, uint16_t speed);
+  ~Capture();
+  bool begin();
+  void end();
+  Client *wrap(Client *client, uint8_t channel);
+  Stream *wrap(Stream *stream, uint8_t channel);
+  void record(uint8_t channel, uint8_t direction, const uint8_t *data, size_t length);
+  void flush(bool all);
+  bool nextRecord(File &replay, uint8_t channel, captureRecord *record);
+  bool isDue(captureRecord *record);
+  void countReplayed(uint8_t channel, size_t length);
+  void replayFinished(uint8_t channel);
+  uint8_t getMode();
+  uint32_t getSize();
+  uint32_t getBytes(uint8_t channel);
+  uint32_t getDuration();
+  bool isFinished();
+private:
+  void writeRecord(uint8_t channel, uint8_t direction);
+  uint8_t                   mode;
+  uint16_t                  speed;                                // Replay speed factor, 0 for as fast as possible
+  uint32_t                  start;                                // Start of recording or replay (ms)
+  uint32_t                  finish = 0;                           // Time (ms) all replayed channels ran out
+  File                      file;
+  uint32_t                  size = 0;                             // Bytes written to capture
+  uint32_t                  bytes[captureChannels];               // Bytes recorded or replayed per channel
+  uint8_t                   active = 0;                           // Bit per channel still being replayed
+  captureBuffer             *buffers = NULL;                      // Per channel and direction while recording
+};
+
+/*
+ * Passes traffic through to the real port or connection and records it
+ */
+class CaptureRecorder : public Client {
+public:
+  CaptureRecorder(Capture *capture, uint8_t channel, Stream *stream, Client *client);
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *buffer, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buffer, size_t size);
+  int peek();
+  int availableForWrite();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+private:
+  Capture                   *capture;
+  uint8_t                   channel;
+  Stream                    *stream;                              // Port or connection
+  Client                    *client;                              // Same as stream for connections, NULL for ports
+};
+
+/*
+ * Stands in for a port or connection, received bytes come from the recording as their time comes and sent bytes are dropped
+ */
+class CaptureReplay : public Client {
+public:
+  CaptureReplay(Capture *capture, uint8_t channel);
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *buffer, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buffer, size_t size);
+  int peek();
+  int availableForWrite();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+private:
+  bool load();
+  Capture                   *capture;
+  uint8_t                   channel;
+  File                      replay;
+  captureRecord             current;
+  uint16_t                  remaining = 0;                        // Bytes of current record not yet read
+  bool                      finished = false;
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,69 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "eventqueue.h"
+
+// The ESP8266 has a single core, keeping the compiler from moving record accesses past the index update is enough
+#define EVENT_QUEUE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/*
+ * Queue event, false when full and the event was dropped. Safe from an interrupt as long as there's one producer
+ */
+bool ICACHE_RAM_ATTR EventQueue::push(const ioEvent *event) {
+  uint32_t count = head - tail;
+  if (count >= EVENT_QUEUE_SIZE) {
+    dropped++;
+    return false;
+  }
+  events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+  EVENT_QUEUE_BARRIER();
+  head++;
+  if (count + 1 > maxCount) {
+    maxCount = count + 1;
+  }
+  return true;
+}
+
+/*
+ * Take oldest event, false when empty
+ */
+bool EventQueue::pop(ioEvent *event) {
+  if (head == tail) {
+    return false;
+  }
+  EVENT_QUEUE_BARRIER();
+  *event = events[tail & (EVENT_QUEUE_SIZE - 1)];
+  EVENT_QUEUE_BARRIER();
+  tail++;
+  return true;
+}
+
+bool EventQueue::isEmpty() {
+  return (head == tail);
+}
+
+uint8_t EventQueue::getCount() {
+  return head - tail;
+}
+
+uint8_t EventQueue::getMaxCount() {
+  return maxCount;
+}
+
+uint32_t EventQueue::getDropped() {
+  return dropped;
+}
@@ -0,0 +1,66 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENTQUEUE_H
+#define EVENTQUEUE_H
+
+#include <Arduino.h>
+
+#define EVENT_QUEUE_SIZE        16          // Queued IO changes, power of two
+
+/*
+ * Kind of IO that changed
+ */
+typedef enum {
+  ioEventInput = 0,
+  ioEventOutput
+} ioEventType;
+
+/*
+ * IO change detected by handleIO, waiting to be published
+ */
+typedef struct {
+  uint8_t                   type;                                 // ioEventType
+  uint8_t                   index;                                // Input or output index
+  uint8_t                   value;                                // Pin value
+  uint8_t                   state;                                // State as published, so after reportInverted
+  int32_t                   deltaTime;                            // Time (ms) spent in previous state
+  uint32_t                  time;                                 // Time (ms) of detection
+} ioEvent;
+
+/*
+ * Single producer, single consumer ring of IO events without locks
+ * Only the producer writes head and dropped, only the consumer writes tail. A full queue drops the newest event and counts it,
+ * the consumer republishes all states once it has drained the queue so the broker ends up with the current state
+ */
+class EventQueue {
+public:
+  bool push(const ioEvent *event);
+  bool pop(ioEvent *event);
+  bool isEmpty();
+  uint8_t getCount();
+  uint8_t getMaxCount();
+  uint32_t getDropped();
+private:
+  ioEvent                   events[EVENT_QUEUE_SIZE];
+  volatile uint32_t         head = 0;                             // Events pushed, free running
+  volatile uint32_t         tail = 0;                             // Events popped, free running
+  volatile uint32_t         dropped = 0;                          // Events lost to a full queue
+  uint8_t                   maxCount = 0;                         // Most events queued at once, seen by producer
+};
+
+#endif // EVENTQUEUE_H
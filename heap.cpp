@@ -0,0 +1,153 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "heap.h"
+
+static const char *heapNames[heapSubsystemCount] = {
+  "sonny", "settings", "logger", "html", "json", "mqtt"
+};
+
+heapUsage Heap::usage[heapSubsystemCount];
+int32_t Heap::attributed = 0;
+uint32_t Heap::allocations = 0;
+uint32_t Heap::setupFree = 0;
+uint32_t Heap::setupMaxBlock = 0;
+
+/*
+ * malloc() accounted to subsystem, NULL when out of memory. Free with Heap::release()
+ */
+void *Heap::allocate(uint8_t subsystem, size_t size) {
+  heapHeader *header = (heapHeader *)malloc(sizeof(heapHeader) + size);
+  if (!header) {
+    return NULL;
+  }
+  header->size = size;
+  header->subsystem = subsystem;
+  header->magic = HEAP_MAGIC;
+  usage[subsystem].allocations++;
+  allocations++;
+  account(subsystem, sizeof(heapHeader) + size);
+  return header + 1;
+}
+
+/*
+ * strdup() accounted to subsystem
+ */
+char *Heap::duplicate(uint8_t subsystem, const char *text) {
+  size_t length = strlen(text) + 1;
+  char *copy = (char *)allocate(subsystem, length);
+  if (copy) {
+    memcpy(copy, text, length);
+  }
+  return copy;
+}
+
+/*
+ * free() block from Heap::allocate(), NULL is ignored
+ */
+void Heap::release(void *pointer) {
+  heapHeader *header;
+  if (!pointer) {
+    return;
+  }
+  header = (heapHeader *)pointer - 1;
+  if (header->magic != HEAP_MAGIC) {
+    // Not ours, don't touch the accounting
+    free(pointer);
+    return;
+  }
+  header->magic = 0x00;
+  account(header->subsystem, -(int32_t)(sizeof(heapHeader) + header->size));
+  free(header);
+}
+
+/*
+ * Add (or with negative bytes remove) heap held by subsystem
+ */
+void Heap::account(uint8_t subsystem, int32_t bytes) {
+  usage[subsystem].current += bytes;
+  attributed += bytes;
+  if (usage[subsystem].current > usage[subsystem].peak) {
+    usage[subsystem].peak = usage[subsystem].current;
+  }
+}
+
+/*
+ * Record short lived use, eg a page being sent, which only counts towards peak and allocations
+ */
+void Heap::sample(uint8_t subsystem, uint32_t bytes) {
+  usage[subsystem].allocations++;
+  allocations++;
+  if (usage[subsystem].current + (int32_t)bytes > usage[subsystem].peak) {
+    usage[subsystem].peak = usage[subsystem].current + bytes;
+  }
+}
+
+/*
+ * Remember usage at end of setup, anything allocated later is steady state
+ */
+void Heap::snapshot() {
+  for (uint8_t i = 0; i < heapSubsystemCount; i++) {
+    usage[i].setupCurrent = usage[i].current;
+    usage[i].setupAllocations = usage[i].allocations;
+  }
+  setupFree = ESP.getFreeHeap();
+  setupMaxBlock = ESP.getMaxFreeBlockSize();
+}
+
+const char *Heap::getName(uint8_t subsystem) {
+  return heapNames[subsystem];
+}
+
+const heapUsage *Heap::getUsage(uint8_t subsystem) {
+  return &usage[subsystem];
+}
+
+/*
+ * Allocations accounted to all subsystems together
+ */
+uint32_t Heap::getAllocations() {
+  return allocations;
+}
+
+/*
+ * Bytes accounted to all subsystems together
+ */
+int32_t Heap::getAttributed() {
+  return attributed;
+}
+
+uint32_t Heap::getSetupFree() {
+  return setupFree;
+}
+
+uint32_t Heap::getSetupMaxBlock() {
+  return setupMaxBlock;
+}
+
+HeapScope::HeapScope(uint8_t subsystem) : subsystem(subsystem) {
+  freeHeap = ESP.getFreeHeap();
+  attributed = Heap::getAttributed();
+}
+
+/*
+ * Account what was allocated in scope and not accounted by tracked blocks or nested scopes
+ */
+HeapScope::~HeapScope() {
+  int32_t used = (int32_t)(freeHeap - ESP.getFreeHeap()) - (Heap::getAttributed() - attributed);
+  Heap::account(subsystem, used);
+}
@@ -0,0 +1,96 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <Arduino.h>
+
+#define HEAP_MAGIC              0xa5        // Marks blocks handed out by Heap::allocate
+
+/*
+ * Owners heap usage is accounted to
+ */
+typedef enum {
+  heapSonny = 0,
+  heapSettings,
+  heapLogger,
+  heapHtml,
+  heapJson,
+  heapMqtt,
+  heapSubsystemCount
+} heapSubsystem;
+
+/*
+ * Usage of one subsystem
+ */
+typedef struct {
+  int32_t                   current;                              // Bytes held
+  int32_t                   peak;                                 // Most bytes held at once
+  uint32_t                  allocations;                          // Allocations made
+  int32_t                   setupCurrent;                         // Bytes held at end of setup
+  uint32_t                  setupAllocations;                     // Allocations made during setup
+} heapUsage;
+
+/*
+ * Precedes every tracked block so release knows size and owner
+ */
+typedef struct {
+  uint16_t                  size;                                 // Requested size
+  uint8_t                   subsystem;                            // heapSubsystem
+  uint8_t                   magic;                                // HEAP_MAGIC
+} heapHeader;
+
+/*
+ * Accounts heap usage per subsystem: tracked blocks exactly, other allocations (objects, Strings) by the change in free heap
+ */
+class Heap {
+public:
+  static void *allocate(uint8_t subsystem, size_t size);
+  static char *duplicate(uint8_t subsystem, const char *text);
+  static void release(void *pointer);
+  static void account(uint8_t subsystem, int32_t bytes);
+  static void sample(uint8_t subsystem, uint32_t bytes);
+  static void snapshot();
+  static const char *getName(uint8_t subsystem);
+  static const heapUsage *getUsage(uint8_t subsystem);
+  static uint32_t getAllocations();
+  static int32_t getAttributed();
+  static uint32_t getSetupFree();
+  static uint32_t getSetupMaxBlock();
+private:
+  static heapUsage          usage[heapSubsystemCount];
+  static int32_t            attributed;                           // Bytes accounted to any subsystem
+  static uint32_t           allocations;                          // Allocations accounted to any subsystem
+  static uint32_t           setupFree;                            // Free heap at end of setup
+  static uint32_t           setupMaxBlock;                        // Largest free block at end of setup
+};
+
+/*
+ * Accounts the change in free heap during its lifetime to a subsystem, minus what was accounted otherwise meanwhile
+ */
+class HeapScope {
+public:
+  HeapScope(uint8_t subsystem);
+  ~HeapScope();
+private:
+  uint8_t                   subsystem;
+  uint32_t                  freeHeap;                             // Free heap at start of scope
+  int32_t                   attributed;                           // Heap::getAttributed() at start of scope
+};
+
+#endif // HEAP_H
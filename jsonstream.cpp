@@ -0,0 +1,240 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "jsonstream.h"
+
+/*
+ * Constructor, write into given buffer (eg MQTT payload)
+ */
+JsonStream::JsonStream(char *buffer, size_t bufferSize) : buffer(buffer), bufferSize(bufferSize) {
+}
+
+/*
+ * Continue document in another (or emptied) buffer, nesting state is kept
+ */
+void JsonStream::setBuffer(char *buffer, size_t bufferSize) {
+  this->buffer = buffer;
+  this->bufferSize = bufferSize;
+  bufferLength = 0;
+  bufferOverflow = false;
+}
+
+/*
+ * Write separator between members and elements when needed
+ */
+void JsonStream::separator() {
+  if (afterKey) {
+    afterKey = false;
+    return;
+  }
+  if (first & (1 << depth)) {
+    first &= ~(1 << depth);
+  } else {
+    write(',');
+  }
+}
+
+/*
+ * Open object or array
+ */
+void JsonStream::open(char bracket) {
+  separator();
+  write(bracket);
+  if (depth < JSONSTREAM_DEPTH - 1) {
+    depth++;
+  }
+  first |= (1 << depth);
+}
+
+/*
+ * Close object or array
+ */
+void JsonStream::close(char bracket) {
+  if (depth > 0) {
+    depth--;
+  }
+  write(bracket);
+}
+
+void JsonStream::beginObject() {
+  open('{');
+}
+
+void JsonStream::endObject() {
+  close('}');
+}
+
+void JsonStream::beginArray() {
+  open('[');
+}
+
+void JsonStream::endArray() {
+  close(']');
+}
+
+/*
+ * Member name, value has to follow
+ */
+void JsonStream::key(const __FlashStringHelper *name) {
+  separator();
+  writeString((const char *)name, true);
+  write(':');
+  afterKey = true;
+}
+
+/*
+ * Member name, value has to follow
+ */
+void JsonStream::key(const char *name) {
+  separator();
+  writeString(name, false);
+  write(':');
+  afterKey = true;
+}
+
+void JsonStream::value(const __FlashStringHelper *text) {
+  separator();
+  writeString((const char *)text, true);
+}
+
+void JsonStream::value(const char *text) {
+  separator();
+  writeString(text, false);
+}
+
+void JsonStream::value(int32_t number) {
+  char digits[12];
+  separator();
+  snprintf(digits, sizeof(digits), "%ld", (long)number);
+  for (char *c = digits; *c; c++) {
+    write(*c);
+  }
+}
+
+void JsonStream::value(uint32_t number) {
+  char digits[12];
+  separator();
+  snprintf(digits, sizeof(digits), "%lu", (unsigned long)number);
+  for (char *c = digits; *c; c++) {
+    write(*c);
+  }
+}
+
+void JsonStream::value(bool state) {
+  separator();
+  for (const char *c = (state ? "true" : "false"); *c; c++) {
+    write(*c);
+  }
+}
+
+void JsonStream::valueNull() {
+  separator();
+  for (const char *c = "null"; *c; c++) {
+    write(*c);
+  }
+}
+
+/*
+ * Float with fixed amount of decimals, avoids pulling in float printf
+ */
+void JsonStream::value(float number, uint8_t decimals) {
+  int32_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+  valueFixed((int32_t)(number * scale + (number < 0 ? -0.5f : 0.5f)), decimals);
+}
+
+/*
+ * Scaled integer written as decimal number, eg 1234 with 3 decimals is 1.234
+ */
+void JsonStream::valueFixed(int32_t number, uint8_t decimals) {
+  char digits[14];
+  uint8_t length;
+  separator();
+  if (number < 0) {
+    write('-');
+    number = -number;
+  }
+  length = snprintf(digits, sizeof(digits), "%0*lu", decimals + 1, (unsigned long)number);
+  for (uint8_t i = 0; i < length; i++) {
+    if (decimals && (i == length - decimals)) {
+      write('.');
+    }
+    write(digits[i]);
+  }
+}
+
+/*
+ * Quoted and escaped string, optionally read from flash
+ */
+void JsonStream::writeString(const char *text, bool flash) {
+  char c;
+  write('"');
+  while ((c = (flash ? pgm_read_byte(text) : *text))) {
+    if ((c == '"') || (c == '\\')) {
+      write('\\');
+      write(c);
+    } else if ((uint8_t)c < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      for (uint8_t i = 0; i < 6; i++) {
+        write(escaped[i]);
+      }
+    } else {
+      write(c);
+    }
+    text++;
+  }
+  write('"');
+}
+
+/*
+ * Add character to buffer
+ */
+void JsonStream::write(char c) {
+  if (bufferLength == bufferSize) {
+    bufferOverflow = true;
+    return;
+  }
+  buffer[bufferLength++] = c;
+}
+
+/*
+ * Terminate the string in the buffer
+ */
+void JsonStream::flush() {
+  if (bufferLength < bufferSize) {
+    buffer[bufferLength] = 0x00;
+  } else {
+    bufferOverflow = true;
+  }
+}
+
+/*
+ * Length of data in buffer
+ */
+size_t JsonStream::length() {
+  return bufferLength;
+}
+
+/*
+ * Did the document not fit in the buffer?
+ */
+bool JsonStream::overflow() {
+  return bufferOverflow;
+}
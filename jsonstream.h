@@ -0,0 +1,65 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <Arduino.h>
+
+#define JSONSTREAM_DEPTH        8           // Maximum nesting of objects and arrays
+
+/*
+ * Writes JSON into a fixed buffer without allocating. The buffer can be swapped between parts of a
+ * document, which allows streaming documents of any size piece by piece
+ */
+class JsonStream {
+public:
+  JsonStream(char *buffer, size_t bufferSize);
+  void setBuffer(char *buffer, size_t bufferSize);
+  void beginObject();
+  void endObject();
+  void beginArray();
+  void endArray();
+  void key(const __FlashStringHelper *name);
+  void key(const char *name);
+  void value(const __FlashStringHelper *text);
+  void value(const char *text);
+  void value(int32_t number);
+  void value(uint32_t number);
+  void value(bool state);
+  void valueNull();
+  void value(float number, uint8_t decimals);
+  void valueFixed(int32_t number, uint8_t decimals);
+  void flush();
+  size_t length();
+  bool overflow();
+private:
+  void separator();
+  void open(char bracket);
+  void close(char bracket);
+  void write(char c);
+  void writeString(const char *text, bool flash);
+  char *buffer;
+  size_t bufferSize;
+  size_t bufferLength = 0;
+  bool bufferOverflow = false;
+  uint8_t depth = 0;
+  uint8_t first = 0x01;                     // Bit per nesting level, set when no member has been written yet
+  bool afterKey = false;
+};
+
+#endif // JSONSTREAM_H
@@ -16,52 +16,58 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "logger.h"
+#include "heap.h"
 
 Logger::Logger() {
   
 }
 
+static const char loggerDebug[] PROGMEM = "DEBUG";
+static const char loggerInfo[] PROGMEM = "INFO";
+static const char loggerWarning[] PROGMEM = "WARNING";
+static const char loggerError[] PROGMEM = "ERROR";
+static const char * const loggerSeverities[4] PROGMEM = {
+  loggerDebug, loggerInfo, loggerWarning, loggerError
+};
+
 /*
- * Format for output - be sure to free() allocated string!
+ * Format for output from a format string in flash, use %S for arguments in flash - be sure to Heap::release() allocated string!
  */
-char *Logger::format(logSeverity severity, char *format, va_list args) {
-  const char *severityStrings[4] = {
-    "DEBUG", "INFO", "WARNING", "ERROR"
-  };
-  char *buffer = (char *)malloc(LOGGER_LINELENGTH);
-  sprintf(buffer, "[%s]: ", severityStrings[severity]);
-  vsnprintf(buffer + strlen(buffer), LOGGER_LINELENGTH - strlen(buffer) + 1, format, args);
+char *Logger::format(logSeverity severity, const __FlashStringHelper *format, va_list args) {
+  char *buffer = (char *)Heap::allocate(heapLogger, LOGGER_LINELENGTH);
+  int length = snprintf_P(buffer, LOGGER_LINELENGTH, PSTR("[%S]: "), (PGM_P)pgm_read_ptr(&loggerSeverities[severity]));
+  vsnprintf_P(buffer + length, LOGGER_LINELENGTH - length, (PGM_P)format, args);
   return buffer;
 }
 
-SerialLogger::SerialLogger(int baudrate) : Logger() {
-  Serial.begin(baudrate);
+SerialLogger::SerialLogger(HardwareSerial *port, int baudrate) : Logger(), port(port) {
+  port->begin(baudrate);
 }
 
 SerialLogger::~SerialLogger() {
-  Serial.end();
+  port->end();
 }
 
 /*
  * Write on serial port
  */
-void SerialLogger::logFormattedVa(logSeverity severity, char *format, va_list args) {
+void SerialLogger::logFormattedVa(logSeverity severity, const __FlashStringHelper *format, va_list args) {
   char *formattedText = Logger::format(severity, format, args);
-  Serial.print(formattedText);
-  free(formattedText);
+  port->print(formattedText);
+  Heap::release(formattedText);
 }
 
 UdpLogger::UdpLogger(const char *host, uint16_t port) : Logger(), port(port) {
-  this->host = strdup(host);
+  this->host = Heap::duplicate(heapLogger, host);
 }
 
 /*
  * Write to LumberLog host
  */
-void UdpLogger::logFormattedVa(logSeverity severity, char *format, va_list args) {
+void UdpLogger::logFormattedVa(logSeverity severity, const __FlashStringHelper *format, va_list args) {
   char *formattedText = Logger::format(severity, format, args);
   UDP.beginPacket(host, port);
   UDP.write(formattedText);
   UDP.endPacket();
-  free(formattedText);
+  Heap::release(formattedText);
 }
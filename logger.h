@@ -35,22 +35,25 @@ public:
 
   Logger();
   ~Logger();
-  virtual void logFormattedVa(logSeverity severity, char *format, va_list args);
+  virtual void logFormattedVa(logSeverity severity, const __FlashStringHelper *format, va_list args);
+  friend class Benchmark;
 protected:
-  static char *format(logSeverity severity, char *format, va_list args);
+  static char *format(logSeverity severity, const __FlashStringHelper *format, va_list args);
 };
 
 class SerialLogger : public Logger {
 public:
-  SerialLogger(int baudrate);
+  SerialLogger(HardwareSerial *port, int baudrate);
   ~SerialLogger();
-  void logFormattedVa(logSeverity severity, char *format, va_list args);
+  void logFormattedVa(logSeverity severity, const __FlashStringHelper *format, va_list args);
+private:
+  HardwareSerial *port;
 };
 
 class UdpLogger : public Logger {
 public:
   UdpLogger(const char *host, uint16_t port);
-  void logFormattedVa(logSeverity severity, char *format, va_list args);
+  void logFormattedVa(logSeverity severity, const __FlashStringHelper *format, va_list args);
 private:
   WiFiUDP UDP;
   const char *host;
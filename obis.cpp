@@ -0,0 +1,172 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "obis.h"
+
+// https://www.netbeheernederland.nl/_upload/Files/Slimme_meter_15_a727fce1f1.pdf
+static const obisField obisFields[obisCount] PROGMEM = {
+  {"1-3:0.2.8",   "version",            "",     obisNumber,     0, 0},
+  {"0-0:1.0.0",   "timestamp",          "s",    obisTimestamp,  0, 0},
+  {"1-0:1.8.1",   "energyInLow",        "kWh",  obisNumber,     3, 0},
+  {"1-0:1.8.2",   "energyInHigh",       "kWh",  obisNumber,     3, 0},
+  {"1-0:2.8.1",   "energyOutLow",       "kWh",  obisNumber,     3, 0},
+  {"1-0:2.8.2",   "energyOutHigh",      "kWh",  obisNumber,     3, 0},
+  {"1-0:1.8.0",   "energyIn",           "kWh",  obisNumber,     3, 0},
+  {"1-0:2.8.0",   "energyOut",          "kWh",  obisNumber,     3, 0},
+  {"0-0:96.14.0", "tariff",             "",     obisNumber,     0, 0},
+  {"1-0:1.7.0",   "powerIn",            "kW",   obisNumber,     3, 0},
+  {"1-0:2.7.0",   "powerOut",           "kW",   obisNumber,     3, 0},
+  {"0-0:17.0.0",  "threshold",          "kW",   obisNumber,     3, 0},
+  {"0-0:96.3.10", "breakerState",       "",     obisNumber,     0, 0},
+  {"0-0:96.7.21", "powerFailures",      "",     obisNumber,     0, 0},
+  {"0-0:96.7.9",  "longPowerFailures",  "",     obisNumber,     0, 0},
+  {"1-0:32.32.0", "sagsL1",             "",     obisNumber,     0, 0},
+  {"1-0:52.32.0", "sagsL2",             "",     obisNumber,     0, 0},
+  {"1-0:72.32.0", "sagsL3",             "",     obisNumber,     0, 0},
+  {"1-0:32.36.0", "swellsL1",           "",     obisNumber,     0, 0},
+  {"1-0:52.36.0", "swellsL2",           "",     obisNumber,     0, 0},
+  {"1-0:72.36.0", "swellsL3",           "",     obisNumber,     0, 0},
+  {"1-0:32.7.0",  "voltageL1",          "V",    obisNumber,     1, 0},
+  {"1-0:52.7.0",  "voltageL2",          "V",    obisNumber,     1, 0},
+  {"1-0:72.7.0",  "voltageL3",          "V",    obisNumber,     1, 0},
+  {"1-0:31.7.0",  "currentL1",          "A",    obisNumber,     0, 0},
+  {"1-0:51.7.0",  "currentL2",          "A",    obisNumber,     0, 0},
+  {"1-0:71.7.0",  "currentL3",          "A",    obisNumber,     0, 0},
+  {"1-0:21.7.0",  "powerInL1",          "kW",   obisNumber,     3, 0},
+  {"1-0:41.7.0",  "powerInL2",          "kW",   obisNumber,     3, 0},
+  {"1-0:61.7.0",  "powerInL3",          "kW",   obisNumber,     3, 0},
+  {"1-0:22.7.0",  "powerOutL1",         "kW",   obisNumber,     3, 0},
+  {"1-0:42.7.0",  "powerOutL2",         "kW",   obisNumber,     3, 0},
+  {"1-0:62.7.0",  "powerOutL3",         "kW",   obisNumber,     3, 0},
+  {"1-0:14.7.0",  "frequency",          "Hz",   obisNumber,     3, 0},
+  {"0-1:24.1.0",  "gasDeviceType",      "",     obisNumber,     0, 0},
+  {"0-1:24.2.1",  "gasIn",              "m3",   obisNumber,     3, 1},
+  {"0-1:24.2.1",  "gasTime",            "s",    obisTimestamp,  0, 0},
+  {"0-1:24.4.0",  "gasValve",           "",     obisNumber,     0, 0},
+  {"0-2:24.2.1",  "waterIn",            "m3",   obisNumber,     3, 1},
+  {"0-2:24.2.1",  "waterTime",          "s",    obisTimestamp,  0, 0}
+};
+
+// Days before the first of each month in a non leap year
+static const uint16_t obisMonthDays[12] PROGMEM = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+/*
+ * Find first table entry from start matching the code at the start of line, -1 when unknown
+ */
+int8_t Obis::find(const char *line, uint8_t start) {
+  for (uint8_t i = start; i < obisCount; i++) {
+    const char *code = obisFields[i].code;
+    uint8_t length = strlen_P(code);
+    if (!strncmp_P(line, code, length) && (line[length] == '(')) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Decode value of table entry from line, false when the line lacks the group
+ */
+bool Obis::parse(const char *line, uint8_t index, int32_t *value) {
+  uint8_t group = pgm_read_byte(&obisFields[index].group);
+  const char *text = line;
+  for (uint8_t i = 0; i <= group; i++) {
+    text = strchr(text, '(');
+    if (!text) {
+      return false;
+    }
+    text++;
+  }
+  if (pgm_read_byte(&obisFields[index].type) == obisTimestamp) {
+    *value = parseTimestamp(text);
+  } else {
+    *value = parseNumber(text, pgm_read_byte(&obisFields[index].decimals));
+  }
+  return true;
+}
+
+/*
+ * Copy table entry from flash
+ */
+void Obis::getField(uint8_t index, obisField *field) {
+  memcpy_P(field, &obisFields[index], sizeof(obisField));
+}
+
+/*
+ * Find table entry by name, -1 when unknown
+ */
+int8_t Obis::findName(const char *name, uint8_t length) {
+  for (uint8_t i = 0; i < obisCount; i++) {
+    const char *fieldName = obisFields[i].name;
+    if ((strlen_P(fieldName) == length) && !strncmp_P(name, fieldName, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Parse decimal number up to '*' or ')' into integer scaled by 10^decimals, eg "01.234*kW" with 3 decimals gives 1234
+ */
+int32_t Obis::parseNumber(const char *text, uint8_t decimals) {
+  int32_t value = 0;
+  int8_t fraction = -1;
+  bool negative = (*text == '-');
+  if (negative) {
+    text++;
+  }
+  for (; *text && (*text != '*') && (*text != ')'); text++) {
+    if (*text == '.') {
+      fraction = 0;
+    } else if ((*text >= '0') && (*text <= '9')) {
+      if (fraction < (int8_t)decimals) {
+        value = value * 10 + (*text - '0');
+        if (fraction >= 0) {
+          fraction++;
+        }
+      }
+    } else {
+      break;
+    }
+  }
+  for (fraction = (fraction < 0 ? 0 : fraction); fraction < decimals; fraction++) {
+    value *= 10;
+  }
+  return (negative ? -value : value);
+}
+
+/*
+ * Parse YYMMDDhhmmss into seconds since 2000-01-01, the trailing S/W (summer/winter time) is ignored
+ */
+int32_t Obis::parseTimestamp(const char *text) {
+  uint8_t part[6];
+  for (uint8_t i = 0; i < 6; i++) {
+    if ((text[0] < '0') || (text[0] > '9') || (text[1] < '0') || (text[1] > '9')) {
+      return 0;
+    }
+    part[i] = (text[0] - '0') * 10 + (text[1] - '0');
+    text += 2;
+  }
+  if ((part[1] < 1) || (part[1] > 12)) {
+    return 0;
+  }
+  int32_t days = part[0] * 365 + (part[0] + 3) / 4 + pgm_read_word(&obisMonthDays[part[1] - 1]) + part[2] - 1;
+  if (((part[0] % 4) == 0) && (part[1] > 2)) {
+    days++;
+  }
+  return ((days * 24 + part[3]) * 60 + part[4]) * 60 + part[5];
+}
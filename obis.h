@@ -0,0 +1,108 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OBIS_H
+#define OBIS_H
+
+#include <Arduino.h>
+
+#define OBIS_CODE_SIZE          12          // Longest OBIS code plus terminator
+#define OBIS_NAME_SIZE          20          // Longest field name plus terminator
+#define OBIS_UNIT_SIZE          5           // Longest unit plus terminator
+
+/*
+ * Kind of value within the parentheses
+ */
+typedef enum {
+  obisNumber = 0,                           // Decimal number, stored scaled by 10^decimals
+  obisTimestamp                             // YYMMDDhhmmssX, stored as seconds since 2000-01-01 local time
+} obisType;
+
+/*
+ * Known DSMR register, lines are matched on code and the value is taken from the given parenthesized group
+ */
+typedef struct {
+  char                      code[OBIS_CODE_SIZE];                 // OBIS reference, eg 1-0:1.7.0
+  char                      name[OBIS_NAME_SIZE];                 // Name used in JSON
+  char                      unit[OBIS_UNIT_SIZE];                 // Unit of scaled value
+  uint8_t                   type;                                 // obisType
+  uint8_t                   decimals;                             // Value is scaled by 10^decimals
+  uint8_t                   group;                                // Index of parenthesized group holding the value
+} obisField;
+
+/*
+ * Index of every field in the table, keep in sync with obisFields
+ */
+typedef enum {
+  obisVersion = 0,
+  obisTimestampLocal,
+  obisEnergyInLow,
+  obisEnergyInHigh,
+  obisEnergyOutLow,
+  obisEnergyOutHigh,
+  obisEnergyIn,
+  obisEnergyOut,
+  obisTariff,
+  obisPowerIn,
+  obisPowerOut,
+  obisThreshold,
+  obisBreakerState,
+  obisPowerFailures,
+  obisLongPowerFailures,
+  obisSagsL1,
+  obisSagsL2,
+  obisSagsL3,
+  obisSwellsL1,
+  obisSwellsL2,
+  obisSwellsL3,
+  obisVoltageL1,
+  obisVoltageL2,
+  obisVoltageL3,
+  obisCurrentL1,
+  obisCurrentL2,
+  obisCurrentL3,
+  obisPowerInL1,
+  obisPowerInL2,
+  obisPowerInL3,
+  obisPowerOutL1,
+  obisPowerOutL2,
+  obisPowerOutL3,
+  obisFrequency,
+  obisGasDeviceType,
+  obisGasIn,
+  obisGasTime,
+  obisGasValve,
+  obisWaterIn,
+  obisWaterTime,
+  obisCount
+} obisIndex;
+
+/*
+ * Lookup and decoding of DSMR P1 telegram lines using a table in flash
+ */
+class Obis {
+public:
+  static int8_t find(const char *line, uint8_t start);
+  static bool parse(const char *line, uint8_t index, int32_t *value);
+  static void getField(uint8_t index, obisField *field);
+  static int8_t findName(const char *name, uint8_t length);
+private:
+  static int32_t parseNumber(const char *text, uint8_t decimals);
+  static int32_t parseTimestamp(const char *text);
+};
+
+#endif // OBIS_H
@@ -0,0 +1,83 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ota.h"
+
+/*
+ * Digest is the "signature", Updater reads it from the end of the image
+ */
+uint32_t OtaDigest::length() {
+  return OTA_DIGEST_SIZE;
+}
+
+/*
+ * Compare digest of image as written with the one appended to it
+ */
+bool OtaDigest::verify(UpdaterHashClass *hash, const void *signature, uint32_t signatureLen) {
+  if (!hash || (signatureLen != OTA_DIGEST_SIZE) || (hash->len() != OTA_DIGEST_SIZE)) {
+    return false;
+  }
+  return (memcmp(hash->hash(), signature, OTA_DIGEST_SIZE) == 0);
+}
+
+/*
+ * Transfer starts
+ */
+void OtaProgress::start() {
+  startTime = millis();
+  lastTime = startTime;
+  bytes = 0;
+  percentage = 0;
+  reported = 0;
+}
+
+/*
+ * Bytes received so far, true when another OTA_REPORT_STEP percent is done
+ */
+bool OtaProgress::update(uint32_t progress, uint32_t total) {
+  bytes = progress;
+  lastTime = millis();
+  percentage = (total ? (uint64_t)progress * 100 / total : 0);
+  if (percentage >= reported + OTA_REPORT_STEP) {
+    reported = percentage - (percentage % OTA_REPORT_STEP);
+    return true;
+  }
+  return false;
+}
+
+uint8_t OtaProgress::getPercentage() {
+  return percentage;
+}
+
+uint32_t OtaProgress::getBytes() {
+  return bytes;
+}
+
+/*
+ * Time (ms) from start until last progress
+ */
+uint32_t OtaProgress::getDuration() {
+  return lastTime - startTime;
+}
+
+/*
+ * Average bytes per second so far
+ */
+uint32_t OtaProgress::getThroughput() {
+  uint32_t duration = getDuration();
+  return (duration ? (uint64_t)bytes * 1000 / duration : 0);
+}
@@ -0,0 +1,57 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OTA_H
+#define OTA_H
+
+#include <Arduino.h>
+// https://github.com/esp8266/Arduino/blob/master/cores/esp8266/Updater.h
+#include <Updater.h>
+
+#define OTA_DIGEST_SIZE         32          // SHA-256 appended by tools/ota_pack.py
+#define OTA_REPORT_STEP         10          // Progress reported every this many percent
+
+/*
+ * Accepts an image when the SHA-256 digest appended by tools/ota_pack.py matches what was written,
+ * this guards against corrupt images, not against forged ones
+ */
+class OtaDigest : public UpdaterVerifyClass {
+public:
+  uint32_t length();
+  bool verify(UpdaterHashClass *hash, const void *signature, uint32_t signatureLen);
+};
+
+/*
+ * Measures transfer of an update for throughput reporting
+ */
+class OtaProgress {
+public:
+  void start();
+  bool update(uint32_t progress, uint32_t total);
+  uint8_t getPercentage();
+  uint32_t getBytes();
+  uint32_t getDuration();
+  uint32_t getThroughput();
+private:
+  uint32_t                  startTime = 0;                        // Start of transfer (ms)
+  uint32_t                  lastTime = 0;                         // Time of last progress (ms)
+  uint32_t                  bytes = 0;                            // Bytes received
+  uint8_t                   percentage = 0;                       // Of total received
+  uint8_t                   reported = 0;                         // Last percentage reported
+};
+
+#endif // OTA_H
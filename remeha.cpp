@@ -0,0 +1,99 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "remeha.h"
+
+// Offsets of room temperature and setpoint were verified on an Avanta, the rest follow the Recom sample layout
+static const remehaField remehaFields[remehaFieldCount] PROGMEM = {
+  {"flowTemp",            "C",    9,  2, true,  2},
+  {"returnTemp",          "C",    11, 2, true,  2},
+  {"dhwTemp",             "C",    13, 2, true,  2},
+  {"outsideTemp",         "C",    15, 2, true,  2},
+  {"calorifierTemp",      "C",    17, 2, true,  2},
+  {"boilerControlTemp",   "C",    19, 2, true,  2},
+  {"roomTemp",            "C",    21, 2, true,  2},
+  {"chSetpoint",          "C",    23, 2, true,  2},
+  {"dhwSetpoint",         "C",    25, 2, true,  2},
+  {"roomSetpoint",        "C",    27, 2, true,  2},
+  {"fanSetpoint",         "rpm",  29, 2, false, 0},
+  {"fanSpeed",            "rpm",  31, 2, false, 0},
+  {"ionisationCurrent",   "uA",   33, 1, false, 1},
+  {"internalSetpoint",    "C",    34, 2, true,  2},
+  {"availablePower",      "%",    36, 1, false, 0},
+  {"pumpPercentage",      "%",    37, 1, false, 0},
+  {"desiredMaxPower",     "%",    39, 1, false, 0},
+  {"modulation",          "%",    40, 1, false, 0},
+  {"state",               "",     47, 1, false, 0},
+  {"lockout",             "",     48, 1, false, 0},
+  {"blocking",            "",     49, 1, false, 0},
+  {"subState",            "",     50, 1, false, 0},
+  {"pressure",            "bar",  56, 1, false, 1}
+};
+
+// Only the sample query is known, further queries (counters, error history) can be appended with their own fields
+static const remehaQueryType remehaQueries[] PROGMEM = {
+  {"sample",  {0x52, 0x05, 0x06, 0x02, 0x00}, 64, remehaFlowTemp, remehaFieldCount}
+};
+
+/*
+ * How many queries are cycled through?
+ */
+uint8_t Remeha::getQueryCount() {
+  return sizeof(remehaQueries) / sizeof(remehaQueryType);
+}
+
+/*
+ * Copy query from flash
+ */
+void Remeha::getQuery(uint8_t index, remehaQueryType *query) {
+  memcpy_P(query, &remehaQueries[index], sizeof(remehaQueryType));
+}
+
+/*
+ * Frame query as STX, command, XOR checksum of command, ETX, returns length
+ */
+uint8_t Remeha::buildQuery(uint8_t index, uint8_t *buffer) {
+  uint8_t checksum = 0;
+  buffer[0] = 0x02;
+  for (uint8_t i = 0; i < REMEHA_COMMAND_SIZE; i++) {
+    buffer[i + 1] = pgm_read_byte(&remehaQueries[index].command[i]);
+    checksum ^= buffer[i + 1];
+  }
+  buffer[REMEHA_COMMAND_SIZE + 1] = checksum;
+  buffer[REMEHA_COMMAND_SIZE + 2] = 0x03;
+  return REMEHA_QUERY_SIZE;
+}
+
+/*
+ * Copy field from flash
+ */
+void Remeha::getField(uint8_t index, remehaField *field) {
+  memcpy_P(field, &remehaFields[index], sizeof(remehaField));
+}
+
+/*
+ * Extract field from response frame, scaled by 10^decimals
+ */
+int32_t Remeha::decode(const uint8_t *frame, uint8_t index) {
+  remehaField field;
+  getField(index, &field);
+  if (field.size == 1) {
+    return (field.isSigned ? (int32_t)(int8_t)frame[field.offset] : (int32_t)frame[field.offset]);
+  }
+  uint16_t value = (frame[field.offset] << 8) + frame[field.offset + 1];
+  return (field.isSigned ? (int32_t)(int16_t)value : (int32_t)value);
+}
@@ -0,0 +1,93 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REMEHA_H
+#define REMEHA_H
+
+#include <Arduino.h>
+
+#define REMEHA_NAME_SIZE        20          // Longest field name plus terminator
+#define REMEHA_UNIT_SIZE        5           // Longest unit plus terminator
+#define REMEHA_COMMAND_SIZE     5           // Query bytes between STX and checksum
+#define REMEHA_QUERY_SIZE       (REMEHA_COMMAND_SIZE + 3)
+
+/*
+ * Value within a response frame, stored big endian like the room temperature and setpoint always were
+ */
+typedef struct {
+  char                      name[REMEHA_NAME_SIZE];               // Name used in JSON
+  char                      unit[REMEHA_UNIT_SIZE];               // Unit of scaled value
+  uint8_t                   offset;                               // Position in frame, STX being 0
+  uint8_t                   size;                                 // 1 or 2 bytes
+  bool                      isSigned;                             // Two's complement
+  uint8_t                   decimals;                             // Value is scaled by 10^decimals
+} remehaField;
+
+/*
+ * Query and the layout of its response
+ */
+typedef struct {
+  char                      name[REMEHA_NAME_SIZE];               // For logging
+  uint8_t                   command[REMEHA_COMMAND_SIZE];         // Bytes between STX and checksum
+  uint8_t                   frameSize;                            // Response length including STX, CRC and ETX
+  uint8_t                   firstField;                           // First field in field table
+  uint8_t                   fieldCount;                           // Amount of fields decoded from response
+} remehaQueryType;
+
+/*
+ * Index of every field in the table, keep in sync with remehaFields
+ */
+typedef enum {
+  remehaFlowTemp = 0,
+  remehaReturnTemp,
+  remehaDhwTemp,
+  remehaOutsideTemp,
+  remehaCalorifierTemp,
+  remehaBoilerControlTemp,
+  remehaRoomTemp,
+  remehaChSetpoint,
+  remehaDhwSetpoint,
+  remehaRoomSetpoint,
+  remehaFanSetpoint,
+  remehaFanSpeed,
+  remehaIonisationCurrent,
+  remehaInternalSetpoint,
+  remehaAvailablePower,
+  remehaPumpPercentage,
+  remehaDesiredMaxPower,
+  remehaModulation,
+  remehaState,
+  remehaLockout,
+  remehaBlocking,
+  remehaSubState,
+  remehaPressure,
+  remehaFieldCount
+} remehaFieldIndex;
+
+/*
+ * Queries and response decoding for the Remeha Recom service port using tables in flash
+ */
+class Remeha {
+public:
+  static uint8_t getQueryCount();
+  static void getQuery(uint8_t index, remehaQueryType *query);
+  static uint8_t buildQuery(uint8_t index, uint8_t *buffer);
+  static void getField(uint8_t index, remehaField *field);
+  static int32_t decode(const uint8_t *frame, uint8_t index);
+};
+
+#endif // REMEHA_H
@@ -0,0 +1,394 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rules.h"
+
+// Indexed by opcode, keep in sync with rulesOpcode
+static const rulesOpInfo rulesOps[rulesOpCount] PROGMEM = {
+  {0, rulesOperandNone,   0, 0},          // Invalid
+  {1, rulesOperandNone,   0, 0},          // Rule
+  {0, rulesOperandNone,   1, 0},          // When
+  {1, rulesOperandNone,   0, 1},          // Push
+  {4, rulesOperandNone,   0, 1},          // PushLong
+  {1, rulesOperandInput,  0, 1},          // Input
+  {1, rulesOperandOutput, 0, 1},          // Output
+  {1, rulesOperandInput,  0, 1},          // Changed
+  {1, rulesOperandInput,  0, 1},          // Held
+  {1, rulesOperandP1,     0, 1},          // P1
+  {1, rulesOperandRemeha, 0, 1},          // Remeha
+  {1, rulesOperandEdge,   1, 1},          // Edge
+  {0, rulesOperandNone,   2, 1},          // Add
+  {0, rulesOperandNone,   2, 1},          // Sub
+  {0, rulesOperandNone,   2, 1},          // Eq
+  {0, rulesOperandNone,   2, 1},          // Ne
+  {0, rulesOperandNone,   2, 1},          // Lt
+  {0, rulesOperandNone,   2, 1},          // Le
+  {0, rulesOperandNone,   2, 1},          // Gt
+  {0, rulesOperandNone,   2, 1},          // Ge
+  {0, rulesOperandNone,   2, 1},          // And
+  {0, rulesOperandNone,   2, 1},          // Or
+  {0, rulesOperandNone,   1, 1},          // Not
+  {1, rulesOperandOutput, 1, 0},          // Set
+  {1, rulesOperandOutput, 0, 0},          // Toggle
+  {0, rulesOperandNone,   1, 0}           // All
+};
+
+Rules::Rules(Sonny *device) : device(device) {
+  memset(held, 0x00, sizeof(held));
+}
+
+Rules::~Rules() {
+  Heap::release(code);
+}
+
+/*
+ * Load compiled rules from SPIFFS, false when missing or invalid
+ */
+bool Rules::load(const char *path) {
+  File f = SPIFFS.open(path, "r");
+  if (!f) {
+    return false;
+  }
+  size_t size = f.size();
+  if (size > sizeof(rulesHeader) + RULES_MAX_SIZE) {
+    f.close();
+    error = 0;
+    return false;
+  }
+  uint8_t *data = (uint8_t*)Heap::allocate(heapSonny, size);
+  if (!data) {
+    f.close();
+    return false;
+  }
+  bool result = (f.read(data, size) == size) && load(data, size);
+  f.close();
+  Heap::release(data);
+  return result;
+}
+
+/*
+ * Take a copy of compiled rules after validating them, getError() tells where they went wrong
+ */
+bool Rules::load(const uint8_t *data, size_t length) {
+  rulesHeader header;
+  Heap::release(code);
+  code = NULL;
+  this->length = 0;
+  ruleCount = 0;
+  error = 0;
+  if (length < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if ((header.magic != RULES_MAGIC) || (header.version != RULES_VERSION) || (header.length > RULES_MAX_SIZE) || (header.length != length - sizeof(header))) {
+    return false;
+  }
+  code = (uint8_t*)Heap::allocate(heapSonny, header.length);
+  if (!code) {
+    return false;
+  }
+  memcpy(code, data + sizeof(header), header.length);
+  this->length = header.length;
+  if (!validate()) {
+    Heap::release(code);
+    code = NULL;
+    this->length = 0;
+    ruleCount = 0;
+    return false;
+  }
+  edges = 0;
+  changed = 0;
+  return true;
+}
+
+/*
+ * Write rules to SPIFFS, replacing the old file only when complete
+ */
+bool Rules::save(const char *path) {
+  rulesHeader header;
+  String temporary = String(path) + ".tmp";
+  File f = SPIFFS.open(temporary, "w");
+  if (!f) {
+    return false;
+  }
+  header.magic = RULES_MAGIC;
+  header.version = RULES_VERSION;
+  header.reserved = 0;
+  header.length = length;
+  bool result = (f.write((const uint8_t*)&header, sizeof(header)) == sizeof(header)) && (f.write(code, length) == length);
+  f.close();
+  if (!result) {
+    SPIFFS.remove(temporary);
+    return false;
+  }
+  SPIFFS.remove(path);
+  return SPIFFS.rename(temporary, String(path));
+}
+
+/*
+ * Check that every rule stays within the program, uses known instructions, stays within the stack and addresses existing IO
+ * Instructions never jump backwards, so a pass executes each byte at most once
+ */
+bool Rules::validate() {
+  rulesOpInfo info;
+  uint16_t pc = 0;
+  uint16_t end;
+  uint8_t opcode;
+  uint8_t operand;
+  uint8_t depth;
+  uint8_t limit;
+  while (pc < length) {
+    error = sizeof(rulesHeader) + pc;
+    if ((code[pc] != rulesOpRule) || (pc + 2 > length)) {
+      return false;
+    }
+    end = pc + 2 + code[pc + 1];
+    if (end > length) {
+      return false;
+    }
+    pc += 2;
+    depth = 0;
+    while (pc < end) {
+      error = sizeof(rulesHeader) + pc;
+      opcode = code[pc];
+      if ((opcode <= rulesOpRule) || (opcode >= rulesOpCount)) {
+        return false;
+      }
+      memcpy_P(&info, &rulesOps[opcode], sizeof(info));
+      if ((pc + 1 + info.operandSize > end) || (depth < info.pops) || (depth - info.pops + info.pushes > RULES_STACK_SIZE)) {
+        return false;
+      }
+      operand = code[pc + 1];
+      switch (info.operandType) {
+        case rulesOperandInput:
+          limit = min(device->getInputCount(), (uint8_t)RULES_INPUTS);
+        break;
+        case rulesOperandOutput:
+          limit = device->getOutputCount();
+        break;
+        case rulesOperandP1:
+          limit = obisCount;
+        break;
+        case rulesOperandRemeha:
+          limit = remehaFieldCount;
+        break;
+        case rulesOperandEdge:
+          limit = RULES_EDGES;
+        break;
+        default:
+          limit = 0xff;
+      }
+      if ((info.operandType != rulesOperandNone) && (operand >= limit)) {
+        return false;
+      }
+      depth = depth - info.pops + info.pushes;
+      pc += 1 + info.operandSize;
+    }
+    ruleCount++;
+  }
+  error = -1;
+  return true;
+}
+
+/*
+ * Remember an input change for the next pass
+ */
+void Rules::inputChanged(uint8_t index, int deltaTime) {
+  if (index < RULES_INPUTS) {
+    changed |= (1UL << index);
+    held[index] = deltaTime;
+  }
+}
+
+/*
+ * Value read by an instruction, false when it isn't available yet
+ */
+bool Rules::fetch(uint8_t opcode, uint8_t operand, int32_t *value) {
+  sonoffIO *io;
+  switch (opcode) {
+    case rulesOpInput:
+      io = device->getInputDevice(operand);
+      *value = io->lastState ^ io->reportInverted;
+      return true;
+    case rulesOpOutput:
+      *value = device->getOutputState(operand);
+      return true;
+    case rulesOpChanged:
+      *value = (changed >> operand) & 1;
+      return true;
+    case rulesOpHeld:
+      *value = ((changed >> operand) & 1) ? held[operand] : 0;
+      return true;
+    case rulesOpP1:
+#ifdef SONNY_P1
+      if (device->p1CheckedPresent & (1ULL << operand)) {
+        *value = device->p1Checked[operand];
+        return true;
+      }
+#endif
+      return false;
+    case rulesOpRemeha:
+#ifdef SONNY_REMEHA
+      if (device->remehaDecoded & (1UL << operand)) {
+        *value = device->remehaValues[operand];
+        return true;
+      }
+#endif
+      return false;
+  }
+  return false;
+}
+
+/*
+ * Switch output when it differs, so level rules don't rewrite outputs every pass
+ */
+void Rules::setOutput(uint8_t index, bool state) {
+  if (device->getOutputState(index) != state) {
+    device->setOutputState(index, state);
+    actions++;
+  }
+}
+
+/*
+ * Evaluate all rules once, called by handleIO() after inputs were read so switched outputs are published in the same pass
+ */
+void Rules::run() {
+  int32_t stack[RULES_STACK_SIZE];
+  uint32_t start = micros();
+  uint16_t pc = 0;
+  uint16_t end;
+  uint8_t depth;
+  uint8_t opcode;
+  uint8_t operand;
+  int32_t value;
+  int32_t a;
+  while (pc < length) {
+    end = pc + 2 + code[pc + 1];
+    pc += 2;
+    depth = 0;
+    while (pc < end) {
+      opcode = code[pc++];
+      operand = (pgm_read_byte(&rulesOps[opcode].operandSize) ? code[pc] : 0);
+      pc += pgm_read_byte(&rulesOps[opcode].operandSize);
+      switch (opcode) {
+        case rulesOpWhen:
+          if (!stack[--depth]) {
+            pc = end;
+          }
+        break;
+        case rulesOpPush:
+          stack[depth++] = (int8_t)operand;
+        break;
+        case rulesOpPushLong:
+          memcpy(&value, code + pc - 4, sizeof(value));
+          stack[depth++] = value;
+        break;
+        case rulesOpInput:
+        case rulesOpOutput:
+        case rulesOpChanged:
+        case rulesOpHeld:
+        case rulesOpP1:
+        case rulesOpRemeha:
+          if (fetch(opcode, operand, &value)) {
+            stack[depth++] = value;
+          } else {
+            skipped++;
+            pc = end;
+          }
+        break;
+        case rulesOpEdge:
+          value = (stack[depth - 1] != 0);
+          stack[depth - 1] = value && !(edges & (1UL << operand));
+          if (value) {
+            edges |= (1UL << operand);
+          } else {
+            edges &= ~(1UL << operand);
+          }
+        break;
+        case rulesOpNot:
+          stack[depth - 1] = !stack[depth - 1];
+        break;
+        case rulesOpSet:
+          setOutput(operand, stack[--depth] != 0);
+        break;
+        case rulesOpToggle:
+          setOutput(operand, !device->getOutputState(operand));
+        break;
+        case rulesOpAll:
+          value = stack[--depth];
+          for (uint8_t i = 0; i < device->getOutputCount(); i++) {
+            setOutput(i, value != 0);
+          }
+        break;
+        default:
+          // Binary operators
+          value = stack[--depth];
+          a = stack[depth - 1];
+          switch (opcode) {
+            case rulesOpAdd: a += value; break;
+            case rulesOpSub: a -= value; break;
+            case rulesOpEq: a = (a == value); break;
+            case rulesOpNe: a = (a != value); break;
+            case rulesOpLt: a = (a < value); break;
+            case rulesOpLe: a = (a <= value); break;
+            case rulesOpGt: a = (a > value); break;
+            case rulesOpGe: a = (a >= value); break;
+            case rulesOpAnd: a = (a && value); break;
+            case rulesOpOr: a = (a || value); break;
+          }
+          stack[depth - 1] = a;
+      }
+    }
+  }
+  changed = 0;
+  passes++;
+  uint32_t runtime = micros() - start;
+  if (runtime > maxRuntime) {
+    maxRuntime = runtime;
+  }
+}
+
+uint8_t Rules::getRuleCount() {
+  return ruleCount;
+}
+
+uint16_t Rules::getLength() {
+  return length;
+}
+
+/*
+ * Offset in file of first invalid byte of last load, -1 when it was valid
+ */
+int16_t Rules::getError() {
+  return error;
+}
+
+uint32_t Rules::getPasses() {
+  return passes;
+}
+
+uint32_t Rules::getActions() {
+  return actions;
+}
+
+uint32_t Rules::getSkipped() {
+  return skipped;
+}
+
+uint32_t Rules::getMaxRuntime() {
+  return maxRuntime;
+}
@@ -0,0 +1,136 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "sonny.h"
+
+#define RULES_FILE              "/rules.bin"
+#define RULES_MAGIC             0x4C555253  // "SRUL", start of compiled rules
+#define RULES_VERSION           1           // Bytecode version, tools/rules.py writes the same
+#define RULES_MAX_SIZE          1024        // Largest bytecode, every byte is executed at most once per pass
+#define RULES_STACK_SIZE        8           // Deepest expression, checked when loading
+#define RULES_EDGES             32          // Edge detectors available to rules
+#define RULES_INPUTS            32          // Inputs rules can see changes of
+
+/*
+ * Instructions, operands are one byte unless noted. A program is a sequence of rules, each starting with an empty stack
+ */
+typedef enum {
+  rulesOpRule = 1,                          // Body length follows, rules can't nest
+  rulesOpWhen,                              // Pop, skip rest of rule when zero
+  rulesOpPush,                              // Push signed byte
+  rulesOpPushLong,                          // Push 4 byte little endian constant
+  rulesOpInput,                             // Push state of input as published
+  rulesOpOutput,                            // Push state of output as published
+  rulesOpChanged,                           // Push 1 when input changed in this pass
+  rulesOpHeld,                              // Push time (ms) input spent in its previous state when it changed in this pass, 0 otherwise
+  rulesOpP1,                                // Push P1 register, skip rest of rule when not in last valid telegram
+  rulesOpRemeha,                            // Push Remeha field, skip rest of rule until decoded
+  rulesOpEdge,                              // Pop, push 1 when non zero and zero in the previous pass of this detector
+  rulesOpAdd,
+  rulesOpSub,
+  rulesOpEq,
+  rulesOpNe,
+  rulesOpLt,
+  rulesOpLe,
+  rulesOpGt,
+  rulesOpGe,
+  rulesOpAnd,
+  rulesOpOr,
+  rulesOpNot,
+  rulesOpSet,                               // Pop, switch output on when non zero and off otherwise, written only when it differs
+  rulesOpToggle,                            // Invert output
+  rulesOpAll,                               // Pop, switch every output
+  rulesOpCount
+} rulesOpcode;
+
+/*
+ * Start of rules file, followed by the bytecode
+ */
+typedef struct {
+  uint32_t                  magic;                                // RULES_MAGIC
+  uint8_t                   version;                              // RULES_VERSION
+  uint8_t                   reserved;
+  uint16_t                  length;                               // Bytes of bytecode
+} rulesHeader;
+
+/*
+ * Operand and stack use of an instruction, used to validate programs when loading
+ */
+typedef struct {
+  uint8_t                   operandSize;                          // Bytes following the opcode
+  uint8_t                   operandType;                          // rulesOperandType
+  uint8_t                   pops;                                 // Values taken from the stack
+  uint8_t                   pushes;                               // Values left on the stack
+} rulesOpInfo;
+
+/*
+ * What an operand refers to, so it can be range checked
+ */
+typedef enum {
+  rulesOperandNone = 0,
+  rulesOperandInput,
+  rulesOperandOutput,
+  rulesOperandP1,
+  rulesOperandRemeha,
+  rulesOperandEdge
+} rulesOperandType;
+
+/*
+ * Evaluates compiled rules against input changes and decoded P1 and Remeha values from handleIO()
+ * Programs are checked when loading so a pass can't overflow the stack, jump backwards or address missing IO
+ */
+class Rules {
+public:
+  Rules(Sonny *device);
+  ~Rules();
+  bool load(const char *path);
+  bool load(const uint8_t *data, size_t length);
+  bool save(const char *path);
+  void inputChanged(uint8_t index, int deltaTime);
+  void run();
+  uint8_t getRuleCount();
+  uint16_t getLength();
+  int16_t getError();
+  uint32_t getPasses();
+  uint32_t getActions();
+  uint32_t getSkipped();
+  uint32_t getMaxRuntime();
+private:
+  bool validate();
+  bool fetch(uint8_t opcode, uint8_t operand, int32_t *value);
+  void setOutput(uint8_t index, bool state);
+  Sonny                     *device;
+  uint8_t                   *code = NULL;                         // Bytecode
+  uint16_t                  length = 0;                           // Bytes of bytecode
+  uint8_t                   ruleCount = 0;                        // Rules found when validating
+  int16_t                   error = -1;                           // Offset of first invalid byte of last load, -1 when valid
+  uint32_t                  changed = 0;                          // Bit per input that changed since last pass
+  int32_t                   held[RULES_INPUTS];                   // Time spent in previous state by changed inputs
+  uint32_t                  edges = 0;                            // Bit per edge detector, condition in previous pass
+  uint32_t                  passes = 0;                           // Evaluations of all rules
+  uint32_t                  actions = 0;                          // Outputs switched by rules
+  uint32_t                  skipped = 0;                          // Rules skipped for lack of P1 or Remeha values
+  uint32_t                  maxRuntime = 0;                       // Longest pass (us)
+};
+
+#endif // RULES_H
@@ -0,0 +1,281 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scheduler.h"
+
+extern "C" {
+#include "osapi.h"
+}
+
+// https://github.com/esp8266/Arduino/blob/master/cores/esp8266/core_esp8266_main.cpp
+extern "C" void esp_schedule();
+extern "C" void esp_yield();
+
+volatile bool Scheduler::idling = false;
+volatile uint32_t Scheduler::wakeTime = 0;
+volatile int8_t Scheduler::levelWakePin = -1;
+
+/*
+ * Register task, returns index or -1 when full
+ */
+int8_t Scheduler::addTask(const char *name, void (*callback)(), uint32_t period, uint32_t budget, bool (*ready)()) {
+  if (taskCount >= SCHEDULER_TASKS) {
+    return -1;
+  }
+  schedulerTask *task = &tasks[taskCount];
+  memset(task, 0x00, sizeof(schedulerTask));
+  task->name = name;
+  task->callback = callback;
+  task->ready = ready;
+  task->period = period;
+  task->budget = budget;
+  task->lastRun = millis();
+  if (ready) {
+    polling = true;
+  }
+  return taskCount++;
+}
+
+/*
+ * Look up task by name, returns index or -1 when not found
+ */
+int8_t Scheduler::findTask(const char *name) {
+  for (uint8_t i = 0; i < taskCount; i++) {
+    if (!strcmp(tasks[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Change period of task
+ */
+void Scheduler::setPeriod(uint8_t index, uint32_t period) {
+  if (index < taskCount) {
+    tasks[index].period = period;
+  }
+}
+
+/*
+ * Change longest idle time while tasks with a readiness condition are registered
+ */
+void Scheduler::setPollInterval(uint32_t interval) {
+  pollInterval = interval;
+}
+
+/*
+ * Edges on pin end idling early and run task right away, eg to poll inputs
+ * With light sleep a low level on the pin wakes the CPU as well, that is only armed while idling with the pin high
+ */
+void Scheduler::setWakePin(uint8_t pin, uint8_t task, bool lightSleep) {
+  if (task >= taskCount) {
+    return;
+  }
+  wakeTask = task;
+  wakePin = pin;
+  wakeLightSleep = lightSleep;
+  attachInterrupt(digitalPinToInterrupt(pin), wakeInterrupt, CHANGE);
+}
+
+/*
+ * Is task due to run?
+ */
+bool Scheduler::isDue(schedulerTask *task, uint32_t now) {
+  if (task->period && (now - task->lastRun >= task->period)) {
+    return true;
+  }
+  return (task->ready && task->ready());
+}
+
+/*
+ * Run all due tasks once, idle when none was due
+ */
+void Scheduler::run() {
+  uint32_t start;
+  uint32_t runtime;
+  uint32_t edge = wakeTime;
+  bool ran = false;
+  for (uint8_t i = 0; i < taskCount; i++) {
+    schedulerTask *task = &tasks[i];
+    bool woken = edge && (i == wakeTask);
+    if (!woken && !isDue(task, millis())) {
+      continue;
+    }
+    start = micros();
+    if (woken) {
+      wakeTime = 0;
+      wakeLatency = start - edge;
+      if (wakeLatency > maxWakeLatency) {
+        maxWakeLatency = wakeLatency;
+      }
+      wakeCount++;
+    }
+    task->lastRun = millis();
+    task->callback();
+    runtime = micros() - start;
+    task->runCount++;
+    if (runtime > task->maxRuntime) {
+      task->maxRuntime = runtime;
+    }
+    if (runtime > task->budget) {
+      task->overrunCount++;
+    }
+    ran = true;
+  }
+  if (!ran) {
+    uint32_t duration = nextDeadline();
+    if (polling && (duration > pollInterval)) {
+      duration = pollInterval;
+    } else if (duration > SCHEDULER_IDLE_MAX) {
+      duration = SCHEDULER_IDLE_MAX;
+    }
+    if (duration) {
+      idle(duration);
+    }
+  }
+}
+
+/*
+ * Suspend loop until timer expires or wake pin changes, the WiFi stack can sleep the modem or CPU meanwhile
+ */
+void Scheduler::idle(uint32_t duration) {
+  uint32_t start = millis();
+  noInterrupts();
+  if (wakeTime) {
+    // Edge arrived while running tasks
+    interrupts();
+    return;
+  }
+  idling = true;
+  if (wakeLightSleep && digitalRead(wakePin) == HIGH) {
+    // Replaces the edge interrupt by a level interrupt, which keeps firing while the pin is low, so only armed
+    // while the pin is high and dropped again by wakeInterrupt()
+    levelWakePin = wakePin;
+    wifi_enable_gpio_wakeup(GPIO_ID_PIN(wakePin), GPIO_PIN_INTR_LOLEVEL);
+  }
+  interrupts();
+  os_timer_setfn(&idleTimer, idleTimeout, NULL);
+  os_timer_arm(&idleTimer, duration, false);
+  esp_yield();
+  os_timer_disarm(&idleTimer);
+  noInterrupts();
+  bool armed = levelWakePin >= 0;
+  levelWakePin = -1;
+  interrupts();
+  if (armed) {
+    // Idle period ended by the timer, level interrupt still armed
+    gpio_pin_wakeup_disable();
+    attachInterrupt(digitalPinToInterrupt(wakePin), wakeInterrupt, CHANGE);
+  }
+  idleTime += millis() - start;
+}
+
+/*
+ * Deadline reached, resume loop unless the wake pin did already
+ */
+void Scheduler::idleTimeout(void *arg) {
+  noInterrupts();
+  bool resume = idling;
+  idling = false;
+  interrupts();
+  if (resume) {
+    esp_schedule();
+  }
+}
+
+/*
+ * Wake pin changed, remember when and resume loop if it's idle
+ */
+void ICACHE_RAM_ATTR Scheduler::wakeInterrupt() {
+  if (levelWakePin >= 0) {
+    // Back to the edge interrupt right away, the level interrupt would keep firing while the pin stays low
+    GPC(levelWakePin) = (GPC(levelWakePin) & ~((0xF << GPCI) | (1 << GPCWE))) | (CHANGE << GPCI);
+    levelWakePin = -1;
+  }
+  if (wakeTime) {
+    return;
+  }
+  wakeTime = micros() | 1; // never 0, which means none pending
+  if (idling) {
+    idling = false;
+    esp_schedule();
+  }
+}
+
+/*
+ * Time (ms) until the first periodic task is due
+ */
+uint32_t Scheduler::nextDeadline() {
+  uint32_t now = millis();
+  uint32_t next = UINT32_MAX;
+  for (uint8_t i = 0; i < taskCount; i++) {
+    if (!tasks[i].period) {
+      continue;
+    }
+    uint32_t elapsed = now - tasks[i].lastRun;
+    if (elapsed >= tasks[i].period) {
+      return 0;
+    }
+    if (tasks[i].period - elapsed < next) {
+      next = tasks[i].period - elapsed;
+    }
+  }
+  return next;
+}
+
+/*
+ * Direct access to task, eg for statistics
+ */
+schedulerTask *Scheduler::getTask(uint8_t index) {
+  return &tasks[index];
+}
+
+/*
+ * How many tasks are there?
+ */
+uint8_t Scheduler::getTaskCount() {
+  return taskCount;
+}
+
+/*
+ * Total time spent idle (ms)
+ */
+uint32_t Scheduler::getIdleTime() {
+  return idleTime;
+}
+
+/*
+ * Amount of wake pin edges handled
+ */
+uint32_t Scheduler::getWakeCount() {
+  return wakeCount;
+}
+
+/*
+ * Last time (us) between wake pin edge and start of wake task
+ */
+uint32_t Scheduler::getWakeLatency() {
+  return wakeLatency;
+}
+
+/*
+ * Longest time (us) between wake pin edge and start of wake task
+ */
+uint32_t Scheduler::getMaxWakeLatency() {
+  return maxWakeLatency;
+}
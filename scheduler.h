@@ -0,0 +1,86 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+extern "C" {
+#include "user_interface.h"
+}
+
+#define SCHEDULER_TASKS         16          // Maximum amount of tasks
+#define SCHEDULER_POLL_INTERVAL 5           // Default longest idle time (ms) when tasks have a readiness condition
+#define SCHEDULER_IDLE_MAX      1000        // Longest idle time (ms) otherwise
+
+/*
+ * Periodic or event driven piece of work
+ */
+typedef struct {
+  const char                *name;                                // Name for status page
+  void                      (*callback)();                        // Work to be done
+  bool                      (*ready)();                           // Optional readiness condition, polled every pass
+  uint32_t                  period;                               // Time between runs (ms), 0 to run on readiness only
+  uint32_t                  budget;                               // Expected maximum runtime (us)
+  uint32_t                  lastRun;                              // Time of last run (ms)
+  uint32_t                  runCount;                             // Amount of runs
+  uint32_t                  overrunCount;                         // Amount of runs exceeding budget
+  uint32_t                  maxRuntime;                           // Longest run (us)
+} schedulerTask;
+
+/*
+ * Cooperative scheduler, runs whichever tasks are due and idles until the next deadline otherwise
+ */
+class Scheduler {
+public:
+  int8_t addTask(const char *name, void (*callback)(), uint32_t period, uint32_t budget, bool (*ready)() = NULL);
+  int8_t findTask(const char *name);
+  void setPeriod(uint8_t index, uint32_t period);
+  void setPollInterval(uint32_t interval);
+  void setWakePin(uint8_t pin, uint8_t task, bool lightSleep);
+  void run();
+  uint32_t nextDeadline();
+  schedulerTask *getTask(uint8_t index);
+  uint8_t getTaskCount();
+  uint32_t getIdleTime();
+  uint32_t getWakeCount();
+  uint32_t getWakeLatency();
+  uint32_t getMaxWakeLatency();
+private:
+  bool isDue(schedulerTask *task, uint32_t now);
+  void idle(uint32_t duration);
+  static void idleTimeout(void *arg);
+  static void wakeInterrupt();
+  schedulerTask tasks[SCHEDULER_TASKS];
+  uint8_t taskCount = 0;
+  bool polling = false;                                           // At least one task has a readiness condition
+  uint32_t pollInterval = SCHEDULER_POLL_INTERVAL;                // Longest idle time when polling
+  uint32_t idleTime = 0;                                          // Total time spent idle (ms)
+  int8_t wakeTask = -1;                                           // Task run right away on a wake pin edge
+  uint8_t wakePin;                                                // Pin of wake interrupt
+  bool wakeLightSleep = false;                                    // Wake pin also wakes the CPU from light sleep
+  uint32_t wakeCount = 0;                                         // Amount of wake pin edges handled
+  uint32_t wakeLatency = 0;                                       // Last time (us) between edge and start of wake task
+  uint32_t maxWakeLatency = 0;                                    // Longest time (us) between edge and start of wake task
+  os_timer_t idleTimer;                                           // Ends idle period at the next deadline
+  static volatile bool idling;                                    // Loop is suspended in idle()
+  static volatile uint32_t wakeTime;                              // Time (us) of wake pin edge, 0 when none pending
+  static volatile int8_t levelWakePin;                            // Pin with light sleep level wakeup armed, -1 when none
+};
+
+#endif // SCHEDULER_H
@@ -16,9 +16,17 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "settingsmanager.h"
+#include "heap.h"
 
-SettingsManager::SettingsManager(const __FlashStringHelper *filename) : filename(filename) {
-  
+SettingsManager::SettingsManager(const __FlashStringHelper *filename, Print *logSerial) : filename(filename), logSerial(logSerial) {
+  memset(settings, 0x00, sizeof(settings));
+}
+
+SettingsManager::~SettingsManager() {
+  for (uint8_t i = 0; i < settingLast; i++) {
+    Heap::release(settings[i].settingValue);
+    Heap::release(settings[i].settingDefaultValue);
+  }
 }
 
 sonoffSetting *SettingsManager::getSetting(sonoffSettingIndex index) {
@@ -35,16 +43,23 @@ sonoffSetting *SettingsManager::getSetting(uint8_t index) {
 void SettingsManager::addSetting(sonoffSettingIndex index, sonoffSettingType settingType, bool visible, const __FlashStringHelper *settingName, const __FlashStringHelper *settingDescription, uint8_t settingLength) {
   settings[index].settingName = settingName;
   settings[index].settingDescription = settingDescription;
-  settings[index].settingValue = (uint8_t*)malloc(settingLength);
-  settings[index].settingDefaultValue = (uint8_t*)malloc(settingLength);
+  settings[index].settingValue = (uint8_t*)Heap::allocate(heapSettings, settingLength);
+  settings[index].settingDefaultValue = (uint8_t*)Heap::allocate(heapSettings, settingLength);
   settings[index].settingLength = settingLength;
   settings[index].settingType = settingType;
   settings[index].visible = visible;
-  if (index == 0) {
-    settings[index].offset = 0;
-  } else {
-    settings[index].offset = settings[index-1].offset + settings[index-1].settingLength;
+}
+
+/*
+ * Checksum over setting count and lengths, identifies the layout of stored settings
+ */
+uint16_t SettingsManager::calculateLayout() {
+  uint8_t count = settingLast;
+  uint16_t crc = calculateCRC16(0xffff, &count, 1);
+  for (uint8_t i = 0; i < settingLast; i++) {
+    crc = calculateCRC16(crc, &settings[i].settingLength, 1);
   }
+  return crc;
 }
 
 /*
@@ -127,59 +142,384 @@ void SettingsManager::setSettingInteger(sonoffSettingIndex setting, int value) {
 }
 
 /*
- * Attempt to restore known values from flash
+ * Attempt to restore known values from RTC memory after a warm reset, otherwise from flash.
+ * The temporary file is only present when compaction got interrupted
  */
 void SettingsManager::restoreSettings() {
   int8_t i;
-  SPIFFS.begin();
-  File f = SPIFFS.open(filename, "r");
-  if (!f) {
-    Serial.println("file open failed");
-    saveSettings(true);
-    restoreSettings();
+  if (restoreSnapshot()) {
+    logSerial->println(F("Restored settings from RTC memory"));
     return;
   }
 
-  Serial.println("Restoring settings from flash");
+  mountFilesystem();
+  if (!restoreJournal(String(filename))) {
+    if (restoreJournal(String(filename) + ".tmp")) {
+      SPIFFS.remove(filename);
+      SPIFFS.rename(String(filename) + ".tmp", String(filename));
+    } else if (!restoreLegacy()) {
+      logSerial->println(F("No valid settings journal, using defaults"));
+      journalLength = 0;
+      saveSettings(true);
+    }
+  }
+
   for (i = 0; i < settingLast; i++) {
-    f.readBytes((char *)settings[i].settingValue, settings[i].settingLength);
-    Serial.print(settings[i].settingName);
-    Serial.print("(");
-    Serial.print(settings[i].settingLength, DEC);
-    Serial.print(")");
-    Serial.print(": ");
+    settings[i].storedCrc = calculateCRC16(0xffff, settings[i].settingValue, settings[i].settingLength);
+    logSerial->print(settings[i].settingName);
+    logSerial->print('(');
+    logSerial->print(settings[i].settingLength, DEC);
+    logSerial->print(')');
+    logSerial->print(F(": "));
     switch (settings[i].settingType) {
       case typeString:
       case typePassword:
-        Serial.println(getSettingString((sonoffSettingIndex)i));
+        logSerial->println(getSettingString((sonoffSettingIndex)i));
       break;
       case typeBool:
-        Serial.println(getSettingBool((sonoffSettingIndex)i) ? F("true") : F("false"));
+        logSerial->println(getSettingBool((sonoffSettingIndex)i) ? F("true") : F("false"));
       break;
       case typeInteger:
-        Serial.println(getSettingInteger((sonoffSettingIndex)i), DEC);
+        logSerial->println(getSettingInteger((sonoffSettingIndex)i), DEC);
       break;
     }
   }
+  saveSnapshot(true);
+}
+
+/*
+ * Mount SPIFFS, skipped at boot when settings came from RTC memory
+ */
+bool SettingsManager::mountFilesystem() {
+  if (!filesystemMounted) {
+    filesystemMounted = SPIFFS.begin();
+  }
+  return filesystemMounted;
+}
+
+/*
+ * Restore settings from RTC memory, which survives everything but a power cycle
+ * Only settings differing from their default are kept there, the others still hold their default
+ */
+bool SettingsManager::restoreSnapshot() {
+  int8_t i;
+  uint16_t offset;
+  settingsRtcHeader header;
+  if (ESP.getResetInfoPtr()->reason == REASON_DEFAULT_RST) {
+    return false;
+  }
+  ESP.rtcUserMemoryRead(SETTINGS_RTC_OFFSET, (uint32_t*)&header, sizeof(header));
+  if ((header.magic != SETTINGS_RTC_MAGIC) || (header.layout != calculateLayout()) || (sizeof(header) + header.length > SETTINGS_RTC_SIZE - SETTINGS_RTC_OFFSET * 4)) {
+    return false;
+  }
+  uint32_t *buffer = (uint32_t*)Heap::allocate(heapSettings, sizeof(header) + header.length + 3);
+  ESP.rtcUserMemoryRead(SETTINGS_RTC_OFFSET, buffer, (sizeof(header) + header.length + 3) & ~3);
+  uint8_t *data = (uint8_t*)buffer + sizeof(header);
+  if (header.crc != calculateCRC16(0xffff, data, header.length)) {
+    Heap::release(buffer);
+    return false;
+  }
+  // Check all records before touching any setting
+  offset = 0;
+  while ((offset < header.length) && (data[offset] < settingLast)) {
+    offset += 1 + settings[data[offset]].settingLength;
+  }
+  if (offset != header.length) {
+    Heap::release(buffer);
+    return false;
+  }
+  offset = 0;
+  while (offset < header.length) {
+    i = data[offset];
+    memcpy(settings[i].settingValue, data + offset + 1, settings[i].settingLength);
+    offset += 1 + settings[i].settingLength;
+  }
+  for (i = 0; i < settingLast; i++) {
+    settings[i].storedCrc = calculateCRC16(0xffff, settings[i].settingValue, settings[i].settingLength);
+  }
+  journalLength = header.journalLength;
+  Heap::release(buffer);
+  return true;
+}
+
+/*
+ * Copy settings as stored in flash to RTC memory, or invalidate the copy when RAM and flash differ
+ * Settings at their default are left out, when the others still don't fit warm resets read flash
+ */
+void SettingsManager::saveSnapshot(bool valid) {
+  int8_t i;
+  settingsRtcHeader header;
+  uint16_t length = 0;
+  for (i = 0; i < settingLast; i++) {
+    if (memcmp(settings[i].settingValue, settings[i].settingDefaultValue, settings[i].settingLength)) {
+      length += 1 + settings[i].settingLength;
+    }
+  }
+  if (sizeof(header) + length > SETTINGS_RTC_SIZE - SETTINGS_RTC_OFFSET * 4) {
+    if (valid && snapshotFits) {
+      logSerial->println(F("Changed settings don't fit in RTC memory, warm resets read flash"));
+    }
+    snapshotFits = false;
+    valid = false;
+    length = 0;
+  } else {
+    snapshotFits = true;
+  }
+  uint32_t *buffer = (uint32_t*)Heap::allocate(heapSettings, sizeof(header) + length + 3);
+  uint8_t *data = (uint8_t*)buffer + sizeof(header);
+  length = 0;
+  for (i = 0; valid && (i < settingLast); i++) {
+    if (memcmp(settings[i].settingValue, settings[i].settingDefaultValue, settings[i].settingLength)) {
+      data[length] = i;
+      memcpy(data + length + 1, settings[i].settingValue, settings[i].settingLength);
+      length += 1 + settings[i].settingLength;
+    }
+  }
+  header.magic = (valid ? SETTINGS_RTC_MAGIC : 0);
+  header.length = length;
+  header.journalLength = journalLength;
+  header.crc = calculateCRC16(0xffff, data, length);
+  header.layout = calculateLayout();
+  memcpy(buffer, &header, sizeof(header));
+  ESP.rtcUserMemoryWrite(SETTINGS_RTC_OFFSET, buffer, (sizeof(header) + length + 3) & ~3);
+  Heap::release(buffer);
+}
+
+/*
+ * Read journal in one go, validate header and replay all committed records
+ */
+bool SettingsManager::restoreJournal(const String &path) {
+  uint16_t offset;
+  uint16_t committed;
+  uint16_t crc;
+  uint8_t *buffer;
+  settingsJournalHeader header;
+  settingsJournalRecord record;
+  File f = SPIFFS.open(path, "r");
+  if (!f) {
+    return false;
+  }
+  uint16_t length = f.size();
+  if ((length < sizeof(settingsJournalHeader)) || (length > SETTINGS_JOURNAL_LIMIT)) {
+    f.close();
+    return false;
+  }
+  buffer = (uint8_t*)Heap::allocate(heapSettings, length);
+  if (f.read(buffer, length) != length) {
+    f.close();
+    Heap::release(buffer);
+    return false;
+  }
   f.close();
+
+  // Records are packed, copy headers out to avoid unaligned access
+  memcpy(&header, buffer, sizeof(header));
+  if ((header.magic != SETTINGS_MAGIC) || (header.version != SETTINGS_VERSION) || (header.crc != calculateCRC16(0xffff, buffer, offsetof(settingsJournalHeader, crc)))) {
+    logSerial->println(F("Settings journal header invalid"));
+    Heap::release(buffer);
+    return false;
+  }
+
+  // First pass: find end of last complete transaction
+  offset = sizeof(settingsJournalHeader);
+  committed = 0;
+  while (offset + sizeof(settingsJournalRecord) <= length) {
+    memcpy(&record, buffer + offset, sizeof(record));
+    if (offset + sizeof(settingsJournalRecord) + record.length > length) {
+      break;
+    }
+    crc = calculateCRC16(0xffff, buffer + offset, offsetof(settingsJournalRecord, crc));
+    crc = calculateCRC16(crc, buffer + offset + sizeof(settingsJournalRecord), record.length);
+    if (crc != record.crc) {
+      break;
+    }
+    offset += sizeof(settingsJournalRecord) + record.length;
+    if (record.index == SETTINGS_RECORD_COMMIT) {
+      committed = offset;
+    }
+  }
+  if (!committed) {
+    logSerial->println(F("Settings journal has no complete transaction"));
+    Heap::release(buffer);
+    return false;
+  }
+
+  // Second pass: apply committed records, unknown settings are skipped to allow downgrades
+  logSerial->println(F("Restoring settings from flash"));
+  offset = sizeof(settingsJournalHeader);
+  while (offset < committed) {
+    memcpy(&record, buffer + offset, sizeof(record));
+    if (record.index < settingLast) {
+      memset(settings[record.index].settingValue, 0x00, settings[record.index].settingLength);
+      memcpy(settings[record.index].settingValue, buffer + offset + sizeof(settingsJournalRecord), min(record.length, settings[record.index].settingLength));
+    }
+    offset += sizeof(settingsJournalRecord) + record.length;
+  }
+  Heap::release(buffer);
+  journalLength = committed;
+  return true;
 }
 
 /*
- * Save settings to flash
+ * Convert settings file written before the journal existed, its values are stored back to back in index order
+ */
+bool SettingsManager::restoreLegacy() {
+  uint8_t i;
+  uint16_t offset = 0;
+  for (i = 0; i < settingWifiBssid; i++) {
+    offset += settings[i].settingLength;
+  }
+  File f = SPIFFS.open(filename, "r");
+  if (!f) {
+    return false;
+  }
+  if ((f.size() != SETTINGS_LEGACY_SIZE) || (offset != SETTINGS_LEGACY_SIZE)) {
+    f.close();
+    return false;
+  }
+  uint8_t *buffer = (uint8_t*)Heap::allocate(heapSettings, SETTINGS_LEGACY_SIZE);
+  if (f.read(buffer, SETTINGS_LEGACY_SIZE) != SETTINGS_LEGACY_SIZE) {
+    f.close();
+    Heap::release(buffer);
+    return false;
+  }
+  f.close();
+
+  logSerial->println(F("Converting settings to journal"));
+  offset = 0;
+  for (i = 0; i < settingWifiBssid; i++) {
+    memcpy(settings[i].settingValue, buffer + offset, settings[i].settingLength);
+    offset += settings[i].settingLength;
+  }
+  Heap::release(buffer);
+  // A failed compaction leaves journalLength 0, the next save retries
+  compactJournal(false);
+  return true;
+}
+
+/*
+ * Save settings to flash, only changed settings are appended to the journal
  */
 bool SettingsManager::saveSettings(bool defaultValue) {
   int8_t i;
-  SPIFFS.begin();
-  File f = SPIFFS.open(filename, "w");
+  uint16_t transactionLength = sizeof(settingsJournalRecord);
+  uint16_t crcs[settingLast];
+  bool result;
+  mountFilesystem();
+  if (defaultValue) {
+    result = compactJournal(true);
+    saveSnapshot(false);
+    return result;
+  }
+
+  for (i = 0; i < settingLast; i++) {
+    crcs[i] = calculateCRC16(0xffff, settings[i].settingValue, settings[i].settingLength);
+    if (crcs[i] != settings[i].storedCrc) {
+      transactionLength += sizeof(settingsJournalRecord) + settings[i].settingLength;
+    }
+  }
+  if (transactionLength == sizeof(settingsJournalRecord)) {
+    return true;
+  }
+  if (!journalLength || (journalLength + transactionLength > SETTINGS_JOURNAL_LIMIT)) {
+    result = compactJournal(false);
+    saveSnapshot(result);
+    return result;
+  }
+
+  File f = SPIFFS.open(filename, "a");
+  if (!f) {
+    logSerial->println(F("file open failed"));
+    return false;
+  }
+  if (f.size() != journalLength) {
+    // Torn write after last commit, start over from a clean file
+    f.close();
+    result = compactJournal(false);
+    saveSnapshot(result);
+    return result;
+  }
+
+  logSerial->println(F("Saving changed settings to flash"));
+  for (i = 0; i < settingLast; i++) {
+    if (crcs[i] != settings[i].storedCrc) {
+      writeRecord(f, i, settings[i].settingValue, settings[i].settingLength);
+    }
+  }
+  writeRecord(f, SETTINGS_RECORD_COMMIT, NULL, 0);
+  f.close();
+  for (i = 0; i < settingLast; i++) {
+    settings[i].storedCrc = crcs[i];
+  }
+  journalLength += transactionLength;
+  saveSnapshot(true);
+  return true;
+}
+
+/*
+ * Write a full snapshot to a temporary file and move it in place
+ */
+bool SettingsManager::compactJournal(bool defaultValue) {
+  int8_t i;
+  uint8_t *value;
+  settingsJournalHeader header;
+  String path = String(filename) + ".tmp";
+  File f = SPIFFS.open(path, "w");
   if (!f) {
-    Serial.println("file open failed");
+    logSerial->println(F("file open failed"));
     return false;
   }
-  
-  Serial.println("Saving settings to flash");
+
+  logSerial->println(F("Saving settings to flash"));
+  header.magic = SETTINGS_MAGIC;
+  header.version = SETTINGS_VERSION;
+  header.settingCount = settingLast;
+  header.crc = calculateCRC16(0xffff, (const uint8_t*)&header, offsetof(settingsJournalHeader, crc));
+  f.write((const uint8_t*)&header, sizeof(header));
+  journalLength = sizeof(header);
   for (i = 0; i < settingLast; i++) {
-    f.write((const uint8_t*)(defaultValue ? settings[i].settingDefaultValue : settings[i].settingValue), settings[i].settingLength);
+    value = (defaultValue ? settings[i].settingDefaultValue : settings[i].settingValue);
+    writeRecord(f, i, value, settings[i].settingLength);
+    settings[i].storedCrc = calculateCRC16(0xffff, value, settings[i].settingLength);
+    journalLength += sizeof(settingsJournalRecord) + settings[i].settingLength;
   }
+  writeRecord(f, SETTINGS_RECORD_COMMIT, NULL, 0);
+  journalLength += sizeof(settingsJournalRecord);
   f.close();
+
+  SPIFFS.remove(filename);
+  if (!SPIFFS.rename(path, String(filename))) {
+    logSerial->println(F("file rename failed"));
+    journalLength = 0;
+    return false;
+  }
   return true;
 }
+
+/*
+ * Append a single record to the journal
+ */
+void SettingsManager::writeRecord(File &f, uint8_t index, const uint8_t *value, uint8_t length) {
+  settingsJournalRecord record;
+  record.index = index;
+  record.length = length;
+  record.crc = calculateCRC16(0xffff, (const uint8_t*)&record, offsetof(settingsJournalRecord, crc));
+  record.crc = calculateCRC16(record.crc, value, length);
+  f.write((const uint8_t*)&record, sizeof(record));
+  if (length) {
+    f.write(value, length);
+  }
+}
+
+/*
+ * CRC16 CCITT (x^16 + x^12 + x^5 + 1)
+ */
+uint16_t SettingsManager::calculateCRC16(uint16_t crc, const uint8_t *buffer, uint16_t length) {
+  for (uint16_t index = 0; index < length; index++) {
+    crc ^= (uint16_t)buffer[index] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
@@ -20,6 +20,15 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "FS.h"
 
+#define SETTINGS_MAGIC          0x534E5953    // "SNYS", start of settings journal
+#define SETTINGS_VERSION        1             // Journal format version
+#define SETTINGS_JOURNAL_LIMIT  1024          // Journal is compacted before it would grow beyond this size
+#define SETTINGS_RECORD_COMMIT  0xFF          // Record index that closes a transaction
+#define SETTINGS_LEGACY_SIZE    289           // Settings file before the journal, raw values of the settings before settingWifiBssid
+#define SETTINGS_RTC_MAGIC      0x52594E53    // "SNYR", start of settings snapshot in RTC memory
+#define SETTINGS_RTC_OFFSET     0             // Snapshot offset in RTC user memory, in 4 byte blocks
+#define SETTINGS_RTC_SIZE       512           // Size of RTC user memory in bytes
+
 /*
  * Identifiers for settings to be stored in flash, to be backwards compatible just add new settings before settingLast
  */
@@ -33,6 +42,33 @@ typedef enum {
   settingMqttUsername,
   settingMqttPassword,
   settingMqttHostFingerprint,
+  settingWifiBssid,
+  settingWifiChannel,
+  settingStaticIp,
+  settingStaticGateway,
+  settingStaticSubnet,
+  settingStaticDns,
+  settingSleepMode,
+  settingWakeInput,
+  settingP1Deadband,
+  settingP1DeadbandPercent,
+  settingP1MinInterval,
+  settingP1Heartbeat,
+  settingP1Fields,
+  settingP1Raw,
+  settingCaptureMode,
+  settingCaptureSpeed,
+  settingOtaVerify,
+  settingMqttTls,
+  settingUdpKey,
+  settingUdpPort,
+  settingRules,
+  settingAnalogInterval,
+  settingAnalogFilter,
+  settingAnalogDeadband,
+  settingAnalogOn,
+  settingAnalogOff,
+  settingAnalogHeartbeat,
   settingLast
 } sonoffSettingIndex;
 
@@ -56,14 +92,47 @@ typedef struct {
   uint8_t                   *settingValue;
   uint8_t                   *settingDefaultValue;
   uint8_t                   settingLength;
-  uint16_t                  offset;
+  uint16_t                  storedCrc;                            // CRC of the value as last written to flash
   uint8_t                   visible = 1;
   uint8_t                   settingType;
 } sonoffSetting;
 
+/*
+ * Journal file header, followed by records
+ */
+typedef struct {
+  uint32_t                  magic;
+  uint8_t                   version;
+  uint8_t                   settingCount;
+  uint16_t                  crc;
+} settingsJournalHeader;
+
+/*
+ * Journal record, followed by length bytes of value. A commit record (index SETTINGS_RECORD_COMMIT)
+ * closes a transaction, records after the last valid commit record are ignored on restore
+ */
+typedef struct {
+  uint8_t                   index;
+  uint8_t                   length;
+  uint16_t                  crc;
+} settingsJournalRecord;
+
+/*
+ * Header of the settings snapshot in RTC memory, followed by the settings differing from their default,
+ * each as its index and settingLength bytes of value
+ */
+typedef struct {
+  uint32_t                  magic;
+  uint16_t                  length;                               // Bytes of records
+  uint16_t                  journalLength;
+  uint16_t                  crc;
+  uint16_t                  layout;                               // CRC of setting count and lengths, a snapshot of other firmware is ignored
+} settingsRtcHeader;
+
 class SettingsManager {
 public:
-  SettingsManager(const __FlashStringHelper *filename);
+  SettingsManager(const __FlashStringHelper *filename, Print *logSerial = &Serial);
+  ~SettingsManager();
   void addSettingString(sonoffSettingIndex index, bool visible, const __FlashStringHelper *settingName, const __FlashStringHelper *settingDescription, const char *defaultValue, uint8_t settingLength);
   void addSettingPassword(sonoffSettingIndex index, bool visible, const __FlashStringHelper *settingName, const __FlashStringHelper *settingDescription, char *defaultValue, uint8_t settingLength);
   void addSettingBool(sonoffSettingIndex index, bool visible, const __FlashStringHelper *settingName, const __FlashStringHelper *settingDescription, bool defaultValue);
@@ -81,12 +150,29 @@ public:
 
   void restoreSettings();
   bool saveSettings(bool defaultValue);
+  bool mountFilesystem();
+
+#ifdef SONNY_BENCHMARK
+  friend class Benchmark;
+#endif
 
 private:
+  bool restoreSnapshot();
+  void saveSnapshot(bool valid);
+  bool restoreJournal(const String &path);
+  bool restoreLegacy();
+  bool compactJournal(bool defaultValue);
+  void writeRecord(File &f, uint8_t index, const uint8_t *value, uint8_t length);
+  static uint16_t calculateCRC16(uint16_t crc, const uint8_t *buffer, uint16_t length);
   void addSetting(sonoffSettingIndex index, sonoffSettingType settingType, bool visible, const __FlashStringHelper *settingName, const __FlashStringHelper *settingDescription, uint8_t settingLength);
+  uint16_t calculateLayout();
 
   const __FlashStringHelper *filename;
+  Print *logSerial;                                               // Messages go to the logging serial port, not a UART taken for P1
   sonoffSetting settings[settingLast];
+  uint16_t journalLength = 0;                                     // Length of valid (committed) journal in flash, 0 if none
+  bool filesystemMounted = false;                                 // SPIFFS is mounted on first use
+  bool snapshotFits = true;                                       // Changed settings fit in RTC memory, to log only once when they don't
 };
 
 #endif // SETTINGSMANAGER_H
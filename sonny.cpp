@@ -16,12 +16,21 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "sonny.h"
+#include "jsonstream.h"
+#include "rules.h"
 
 // https://bblanchon.github.io/ArduinoJson/
 #include <ArduinoJson.h>
 
+// Low-water mark of the heap, https://github.com/esp8266/Arduino/tree/master/cores/esp8266/umm_malloc
+#include <umm_malloc/umm_malloc.h>
+
 Sonny *Sonny::SingleSonny = NULL;
 
+// Series keep 10 minutes at 10 s, 24 hours at 5 min and a week at 1 hour
+static const uint32_t seriesResolutions[TIMESERIES_LEVELS] = {10000, 300000, 3600000};
+static const uint16_t seriesLengths[TIMESERIES_LEVELS] = {60, 288, 168};
+
 
 
 #ifdef SONNY_REMEHA
@@ -50,7 +59,7 @@ uint16_t *Sonny::remehaCrcTable = crcTable;
 /*
  * Setup device specific IOs and create their pub/sub handlers
  */
-Sonny *Sonny::setupDevice(WiFiClient *wifiClient, SettingsManager *settings) {
+Sonny *Sonny::setupDevice(Client *wifiClient, SettingsManager *settings, Capture *capture) {
   Sonny *device = NULL;
 #if SONOFF_DEVICE == SONOFF
   device = new SonnyS20(wifiClient, settings);
@@ -68,6 +77,9 @@ Sonny *Sonny::setupDevice(WiFiClient *wifiClient, SettingsManager *settings) {
   analogWriteRange(PWMRANGE);
   analogWriteFreq(1);
   device->initialiseIO();
+  if (capture) {
+    device->setupCapture(capture);
+  }
   Sonny::SingleSonny = device;
   return device;
 }
@@ -75,31 +87,179 @@ Sonny *Sonny::setupDevice(WiFiClient *wifiClient, SettingsManager *settings) {
 /*
  * Reserve heap space for IO etc
  */
-Sonny::Sonny(WiFiClient *wifiClient, SettingsManager *settings, uint8_t inputCount, uint8_t outputCount, uint8_t ledCount) : wifiClient(wifiClient), settings(settings), inputCount(inputCount), outputCount(outputCount), ledCount(ledCount) {
-  inputs = (sonoffIO**)malloc(sizeof(sonoffIO*) * inputCount);
-  outputs = (sonoffIO**)malloc(sizeof(sonoffIO*) * outputCount);
-  leds = (sonoffLED**)malloc(sizeof(sonoffLED*) * ledCount);
+Sonny::Sonny(Client *wifiClient, SettingsManager *settings, uint8_t inputCount, uint8_t outputCount, uint8_t ledCount) : wifiClient(wifiClient), settings(settings), inputCount(inputCount), outputCount(outputCount), ledCount(ledCount) {
+  HeapScope scope(heapMqtt);
+  inputs = (sonoffIO**)Heap::allocate(heapSonny, sizeof(sonoffIO*) * inputCount);
+  outputs = (sonoffIO**)Heap::allocate(heapSonny, sizeof(sonoffIO*) * outputCount);
+  leds = (sonoffLED**)Heap::allocate(heapSonny, sizeof(sonoffLED*) * ledCount);
   mqtt = new Adafruit_MQTT_Client(wifiClient, settings->getSettingString(settingMqttHost), settings->getSettingInteger(settingMqttPort), settings->getSettingString(settingMqttUsername), settings->getSettingString(settingMqttPassword));
 #ifdef SONNY_P1
-  p1Io = (sonoffIO*)malloc(sizeof(sonoffIO));
+  p1Io = (sonoffIO*)Heap::allocate(heapSonny, sizeof(sonoffIO));
 #endif
 #ifdef SONNY_REMEHA
-  remehaIo = (sonoffIO*)malloc(sizeof(sonoffIO));
+  remehaIo = (sonoffIO*)Heap::allocate(heapSonny, sizeof(sonoffIO));
 #endif
 }
 
 /*
  * Wrapper for logger
  */
-void Sonny::logFormatted(Logger::logSeverity severity, char *format, ...) {
+void Sonny::logFormatted(Logger::logSeverity severity, const __FlashStringHelper *format, ...) {
   va_list args;
+  va_list loggerArgs;
   va_start (args, format);
   for (uint8_t i = 0; i < loggerCount; i++) {
-    loggers[i]->logFormattedVa(severity, format, args);
+    // Every logger consumes the arguments
+    va_copy(loggerArgs, args);
+    loggers[i]->logFormattedVa(severity, format, loggerArgs);
+    va_end(loggerArgs);
   }
   va_end (args);
 }
 
+/*
+ * Register function receiving IO and telemetry changes
+ */
+void Sonny::setEventListener(void (*listener)(const char *event, const char *data)) {
+  eventListener = listener;
+}
+
+/*
+ * Replace rules evaluated by handleIO, NULL to stop evaluating rules
+ */
+void Sonny::setRules(Rules *rules) {
+  this->rules = rules;
+}
+
+Rules *Sonny::getRules() {
+  return rules;
+}
+
+EventQueue *Sonny::getEventQueue() {
+  return &ioEvents;
+}
+
+uint32_t Sonny::getMaxEventLatency() {
+  return maxEventLatency;
+}
+
+uint32_t Sonny::getResyncCount() {
+  return resyncCount;
+}
+
+AnalogInput *Sonny::getAnalog() {
+  return analog;
+}
+
+uint32_t Sonny::getAnalogPublishes() {
+  return analogPublishes;
+}
+
+/*
+ * Register the device's work with the scheduler
+ */
+void Sonny::registerTasks(Scheduler *scheduler) {
+  scheduler->addTask("io", ioTask, 10, 2000);
+  scheduler->addTask("publish", publishTask, 0, 20000, publishReady);
+  scheduler->addTask("mqtt", mqttTask, 100, 20000, mqttReady);
+  scheduler->addTask("ping", pingTask, pingInterval, 50000);
+  scheduler->addTask("stats", statsTask, statsInterval, 20000);
+  scheduler->addTask("analog", analogTask, 0, 20000, analogReady);
+#ifdef SONNY_P1
+  scheduler->addTask("p1", p1Task, 0, 20000, p1Ready);
+#endif
+#ifdef SONNY_REMEHA
+  scheduler->addTask("remeha query", remehaQueryTask, remehaInterval, 2000);
+  scheduler->addTask("remeha receive", remehaReceiveTask, 0, 20000, remehaReadyTask);
+#endif
+}
+
+/*
+ * Scheduler trampolines
+ */
+void Sonny::ioTask() {
+  SingleSonny->handleIO();
+}
+
+void Sonny::mqttTask() {
+  SingleSonny->handleMQTT();
+}
+
+bool Sonny::mqttReady() {
+  return SingleSonny->wifiClient->available();
+}
+
+void Sonny::publishTask() {
+  SingleSonny->publishEvents();
+}
+
+bool Sonny::publishReady() {
+  return (!SingleSonny->ioEvents.isEmpty() || (SingleSonny->ioEvents.getDropped() != SingleSonny->resyncDropped)) && SingleSonny->publishWritable();
+}
+
+void Sonny::pingTask() {
+  SingleSonny->mqttPing();
+}
+
+void Sonny::statsTask() {
+  SingleSonny->publishStats();
+}
+
+void Sonny::analogTask() {
+  SingleSonny->handleAnalog();
+}
+
+bool Sonny::analogReady() {
+  return SingleSonny->analog && SingleSonny->analog->available();
+}
+
+#ifdef SONNY_P1
+void Sonny::p1Task() {
+  SingleSonny->handleP1();
+}
+
+bool Sonny::p1Ready() {
+  return SingleSonny->p1Serial->available();
+}
+#endif
+
+#ifdef SONNY_REMEHA
+void Sonny::remehaQueryTask() {
+  SingleSonny->remehaQuery();
+}
+
+void Sonny::remehaReceiveTask() {
+  SingleSonny->remehaReceive();
+}
+
+bool Sonny::remehaReadyTask() {
+  return SingleSonny->remehaReady();
+}
+#endif
+
+/*
+ * Pass IO change to event listener
+ */
+void Sonny::notifyIoEvent(const char *event, uint8_t index, int32_t value, bool state, int deltaTime) {
+  char data[80];
+  if (!eventListener) {
+    return;
+  }
+  JsonStream json(data, sizeof(data));
+  json.beginObject();
+  json.key(F("id"));
+  json.value((uint32_t)index);
+  json.key(F("value"));
+  json.value(value);
+  json.key(F("state"));
+  json.value(state ? F("on") : F("off"));
+  json.key(F("deltaTime"));
+  json.value((int32_t)deltaTime);
+  json.endObject();
+  json.flush();
+  eventListener(event, data);
+}
+
 /*
  * Are we in setup mode?
  */
@@ -188,7 +348,7 @@ void Sonny::writeOutput(uint8_t index, uint8_t value) {
  * Add IO device to array and assign pin
  */
 void Sonny::addIoDevice(sonoffIO **list, uint8_t index, uint8_t pin) {
-  list[index] = (sonoffIO*)malloc(sizeof(sonoffIO));
+  list[index] = (sonoffIO*)Heap::allocate(heapSonny, sizeof(sonoffIO));
   memset(list[index], 0x00, sizeof(sonoffIO));
   list[index]->pin = pin;
 }
@@ -198,7 +358,7 @@ void Sonny::addIoDevice(sonoffIO **list, uint8_t index, uint8_t pin) {
  */
 void Sonny::addLed(uint8_t index, uint8_t pin) {
   if (ledCount > index) {
-    leds[index] = (sonoffLED*)malloc(sizeof(sonoffLED));
+    leds[index] = (sonoffLED*)Heap::allocate(heapSonny, sizeof(sonoffLED));
     leds[index]->pin = pin;
     leds[index]->dutyCycle = PWMRANGE;
   }
@@ -267,7 +427,7 @@ void Sonny::resetConfig(uint8_t index) {
  * Increment counter and set outputs according to bits
  */
 void Sonny::countedOutput(uint8_t index) {
-  logFormatted(Logger::severityInfo, "Counted output triggered: %d\r\n", outputCounter);
+  logFormatted(Logger::severityInfo, F("Counted output triggered: %d\r\n"), outputCounter);
   if (outputCounter == outputLimitCounter) {
     outputCounter = 0;
   } else {
@@ -290,24 +450,25 @@ void Sonny::initialiseIO() {
   uint8_t i;
   char *topic;
   const int topicSize = 32;
-  logFormatted(Logger::severityInfo, "Configuring IO\r\n");
+  HeapScope scope(heapMqtt);
+  logFormatted(Logger::severityInfo, F("Configuring IO\r\n"));
   for (i = 0; i < inputCount; i++) {
     setupInput(i);
     inputs[i]->lastState = readInput(i);
     inputs[i]->lastStateTime = millis();
-    topic = (char *)malloc(topicSize);
+    topic = (char *)Heap::allocate(heapMqtt, topicSize);
     snprintf(topic, topicSize, "sonoff/%s/input/%d", settings->getSettingString(settingHostname), i);
     inputs[i]->mqttPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
-    inputs[i]->publishTopic = strdup(topic);
+    inputs[i]->publishTopic = Heap::duplicate(heapMqtt, topic);
   }
   for (i = 0; i < outputCount; i++) {
     setupOutput(i);
     outputs[i]->lastState = readOutput(i);
-    topic = (char *)malloc(topicSize);
+    topic = (char *)Heap::allocate(heapMqtt, topicSize);
     snprintf(topic, topicSize, "sonoff/%s/output/%d", settings->getSettingString(settingHostname), i);
     outputs[i]->mqttPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
-    outputs[i]->publishTopic = strdup(topic);
-    topic = (char *)malloc(topicSize);
+    outputs[i]->publishTopic = Heap::duplicate(heapMqtt, topic);
+    topic = (char *)Heap::allocate(heapMqtt, topicSize);
     snprintf(topic, topicSize, "sonoff/%s/switch/%d", settings->getSettingString(settingHostname), i);
     outputs[i]->mqttSubscriber = new Adafruit_MQTT_Subscribe(mqtt, topic);
     mqtt->subscribe(outputs[i]->mqttSubscriber);
@@ -316,24 +477,111 @@ void Sonny::initialiseIO() {
     pinMode(leds[i]->pin, OUTPUT);
     analogWrite(leds[i]->pin, leds[i]->dutyCycle);
   }
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
+  snprintf(topic, topicSize, "sonoff/%s/history", settings->getSettingString(settingHostname));
+  historyPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
+  snprintf(topic, topicSize, "sonoff/%s/history/get", settings->getSettingString(settingHostname));
+  historySubscriber = new Adafruit_MQTT_Subscribe(mqtt, topic);
+  mqtt->subscribe(historySubscriber);
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
+  snprintf(topic, topicSize, "sonoff/%s/stats", settings->getSettingString(settingHostname));
+  statsTopic = topic;
+  if (settings->getSettingInteger(settingAnalogInterval) > 0) {
+    HeapScope analogScope(heapSonny);
+    analogIo = (sonoffIO*)Heap::allocate(heapSonny, sizeof(sonoffIO));
+    memset(analogIo, 0x00, sizeof(sonoffIO));
+    topic = (char *)Heap::allocate(heapMqtt, topicSize);
+    snprintf(topic, topicSize, "sonoff/%s/analog/0", settings->getSettingString(settingHostname));
+    analogIo->mqttPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
+    analogIo->publishTopic = Heap::duplicate(heapMqtt, topic);
+    analog = new AnalogInput(A0, settings->getSettingInteger(settingAnalogInterval), settings->getSettingInteger(settingAnalogFilter));
+    analog->begin();
+  }
 #ifdef SONNY_P1
-  p1Serial = new SoftwareSerial(4, -1, true, SOFTSERIAL_BUFFERSIZE); // (RX, TX. inverted, buffer);
-  p1Serial->begin(115200);
-  topic = (char *)malloc(topicSize);
+  {
+    HeapScope serialScope(heapSonny);
+    // Bit banging 115200 baud loses bytes to WiFi interrupts, the UART doesn't. P1 is inverted and receive only
+    Serial.setRxBufferSize(P1_RX_BUFFER);
+    Serial.begin(P1_BAUDRATE, SERIAL_8N1, SERIAL_RX_ONLY, 1, true);
+    Serial.swap();                      // RX on GPIO13
+    p1Uart = &Serial;
+    p1Serial = p1Uart;
+  }
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
   snprintf(topic, topicSize, "sonoff/%s/p1/read", settings->getSettingString(settingHostname));
   p1Io->mqttPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
-  p1Io->publishTopic = strdup(topic);
+  p1Io->publishTopic = Heap::duplicate(heapMqtt, topic);
+  p1SelectFields(settings->getSettingString(settingP1Fields));
+  p1Raw = settings->getSettingInteger(settingP1Raw);
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
+  snprintf(topic, topicSize, "sonoff/%s/p1/raw", settings->getSettingString(settingHostname));
+  p1RawTopic = topic;
+  p1Series[P1_POWER_IN] = addSeries("powerIn", 3);
+  p1Series[P1_POWER_OUT] = addSeries("powerOut", 3);
+  p1Series[P1_GAS_IN] = addSeries("gas", 3);
 #endif
 #ifdef SONNY_REMEHA
-  remehaSerial = new SoftwareSerial(4, 5, false, SOFTSERIAL_BUFFERSIZE); // (RX, TX. inverted, buffer);
-  remehaSerial->begin(9600);
-  topic = (char *)malloc(topicSize);
+  {
+    HeapScope serialScope(heapSonny);
+    remehaSoftSerial = new SoftwareSerial(REMEHA_RX_PIN, REMEHA_TX_PIN, false, REMEHA_RX_BUFFER); // (RX, TX. inverted, buffer);
+    remehaSoftSerial->begin(REMEHA_BAUDRATE);
+    remehaSerial = remehaSoftSerial;
+  }
+  topic = (char *)Heap::allocate(heapMqtt, topicSize);
   snprintf(topic, topicSize, "sonoff/%s/remeha/read", settings->getSettingString(settingHostname));
   remehaIo->mqttPublisher = new Adafruit_MQTT_Publish(mqtt, topic);
-  remehaIo->publishTopic = strdup(topic);
+  remehaIo->publishTopic = Heap::duplicate(heapMqtt, topic);
+  roomTempSeries = addSeries("roomTemp", 2);
+  roomSetpointSeries = addSeries("roomSetpoint", 2);
 #endif
 }
 
+/*
+ * Create downsampled series, NULL when there is no room
+ */
+Timeseries *Sonny::addSeries(const char *name, uint8_t decimals) {
+  if (seriesCount >= SERIES_MAX) {
+    return NULL;
+  }
+  HeapScope scope(heapSonny);
+  series[seriesCount] = new Timeseries(name, decimals, seriesResolutions, seriesLengths);
+  return series[seriesCount++];
+}
+
+/*
+ * How many series are there?
+ */
+uint8_t Sonny::getSeriesCount() {
+  return seriesCount;
+}
+
+/*
+ * Get series by index
+ */
+Timeseries *Sonny::getSeries(uint8_t index) {
+  return series[index];
+}
+
+/*
+ * Get series by name, NULL when unknown
+ */
+Timeseries *Sonny::findSeries(const char *name) {
+  for (uint8_t i = 0; i < seriesCount; i++) {
+    if (!strcmp(series[i]->getName(), name)) {
+      return series[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * ESP pin of input, -1 when it isn't one
+ */
+int8_t Sonny::getInputPin(uint8_t index) {
+  return inputs[index]->pin;
+}
+
 /*
  * Set up ESP input pin
  */
@@ -348,6 +596,18 @@ void Sonny::setupOutput(uint8_t index) {
   pinMode(outputs[index]->pin, OUTPUT);
 }
 
+/*
+ * Route serial ports through capture for recording or replay
+ */
+void Sonny::setupCapture(Capture *capture) {
+#ifdef SONNY_P1
+  p1Serial = capture->wrap(p1Serial, captureP1);
+#endif
+#ifdef SONNY_REMEHA
+  remehaSerial = capture->wrap(remehaSerial, captureRemeha);
+#endif
+}
+
 /*
  * Placeholder for read all in subclasses
  */
@@ -363,7 +623,55 @@ void Sonny::writeAll() {
 }
 
 /*
- * Read I/O, trigger and publish
+ * Queue IO change for the publish task, so a slow broker never holds up sampling and triggers
+ */
+void Sonny::queueIoEvent(uint8_t type, uint8_t index, uint8_t value, bool state, int deltaTime) {
+  ioEvent event;
+  event.type = type;
+  event.index = index;
+  event.value = value;
+  event.state = state;
+  event.deltaTime = deltaTime;
+  event.time = millis();
+  ioEvents.push(&event);
+}
+
+/*
+ * Publish queued IO changes while the connection has room for them without blocking
+ * Changes dropped by a full queue are made up for by publishing every state once the queue is drained
+ */
+void Sonny::publishEvents() {
+  ioEvent event;
+  sonoffIO *io;
+  while (publishWritable() && ioEvents.pop(&event)) {
+    io = (event.type == ioEventInput ? inputs : outputs)[event.index];
+    tryMqttPublish(io->mqttPublisher, "bool", event.value, event.state, event.deltaTime);
+    if (millis() - event.time > maxEventLatency) {
+      maxEventLatency = millis() - event.time;
+    }
+  }
+  if (ioEvents.isEmpty() && (ioEvents.getDropped() != resyncDropped) && publishWritable()) {
+    logFormatted(Logger::severityWarning, F("IO events dropped, publishing all states\r\n"));
+    resyncDropped = ioEvents.getDropped();
+    resyncCount++;
+    for (uint8_t i = 0; i < inputCount; i++) {
+      tryMqttPublish(inputs[i]->mqttPublisher, "bool", inputs[i]->lastState, inputs[i]->lastState ^ inputs[i]->reportInverted, millis() - inputs[i]->lastStateTime);
+    }
+    for (uint8_t i = 0; i < outputCount; i++) {
+      tryMqttPublish(outputs[i]->mqttPublisher, "bool", outputs[i]->lastState, outputs[i]->lastState ^ outputs[i]->reportInverted, 0);
+    }
+  }
+}
+
+/*
+ * Is the broker connected with room for a publish in the transmit buffer?
+ */
+bool Sonny::publishWritable() {
+  return (mqtt->connected() && (wifiClient->availableForWrite() >= MQTT_EVENT_SPACE));
+}
+
+/*
+ * Read I/O, trigger and queue changes for publishing
  */
 void Sonny::handleIO() {
   uint8_t currentValue;
@@ -374,15 +682,16 @@ void Sonny::handleIO() {
     currentValue = readInput(i);
     if (currentValue != inputs[i]->lastState) {
       deltaTime = millis() - inputs[i]->lastStateTime;
-      logFormatted(Logger::severityDebug, "Input %d now has state %d (delta %d)\r\n", i, currentValue, deltaTime);
+      logFormatted(Logger::severityDebug, F("Input %d now has state %d (delta %d)\r\n"), i, currentValue, deltaTime);
+      notifyIoEvent("input", i, currentValue, currentValue ^ inputs[i]->reportInverted, deltaTime);
       if ((inputs[i]->triggerPublishState == 2) && (deltaTime > 500)) {
-        tryMqttPublish(inputs[i]->mqttPublisher, currentValue, currentValue ^ inputs[i]->reportInverted, deltaTime);
+        queueIoEvent(ioEventInput, i, currentValue, currentValue ^ inputs[i]->reportInverted, deltaTime);
         if (inputs[i]->triggers[0]) { // trigger 0
           inputs[i]->triggers[0](i);
         }
       } else if (currentValue == inputs[i]->triggerPublishState) {
         // publish
-        tryMqttPublish(inputs[i]->mqttPublisher, currentValue, currentValue ^ inputs[i]->reportInverted, deltaTime);
+        queueIoEvent(ioEventInput, i, currentValue, currentValue ^ inputs[i]->reportInverted, deltaTime);
         if ((deltaTime < 500) && (inputs[i]->triggers[0])) { // trigger 0
           inputs[i]->triggers[0](i);
         } else if ((deltaTime < 2000) && (inputs[i]->triggers[1])) { // trigger 1
@@ -395,124 +704,356 @@ void Sonny::handleIO() {
       }
       inputs[i]->lastState = currentValue;
       inputs[i]->lastStateTime = millis();
+      if (rules) {
+        rules->inputChanged(i, deltaTime);
+      }
     }
   }
+  if (rules) {
+    rules->run();
+  }
   for (i = 0; i < outputCount; i++) {
     currentValue = readOutput(i);
     if (currentValue != outputs[i]->lastState) {
-      logFormatted(Logger::severityDebug, "Output %d now has state %d, was %d\r\n", i, outputs[i]->lastState, currentValue);
+      logFormatted(Logger::severityDebug, F("Output %d now has state %d, was %d\r\n"), i, outputs[i]->lastState, currentValue);
       // publish
-      tryMqttPublish(outputs[i]->mqttPublisher, currentValue, currentValue ^ outputs[i]->reportInverted, 0);
+      queueIoEvent(ioEventOutput, i, currentValue, currentValue ^ outputs[i]->reportInverted, 0);
+      notifyIoEvent("output", i, currentValue, currentValue ^ outputs[i]->reportInverted, 0);
       outputs[i]->lastState = currentValue;
     }
   }
+}
+
+/*
+ * Take filtered analog sample, apply the thresholds and publish when it moved enough
+ * A publish waiting for room in the transmit buffer is retried with the next sample, so the rate follows the signal and the broker
+ */
+void Sonny::handleAnalog() {
+  int32_t value = analog->read();
+  uint8_t state = analogIo->lastState;
+  // Hysteresis keeps a value hovering around a single threshold from toggling the state
+  if (!state && (value >= settings->getSettingInteger(settingAnalogOn))) {
+    state = 1;
+  } else if (state && (value <= settings->getSettingInteger(settingAnalogOff))) {
+    state = 0;
+  }
+  if (state != analogIo->lastState) {
+    logFormatted(Logger::severityDebug, F("Analog now has state %d at %d\r\n"), state, value);
+    analogIo->lastState = state;
+    analogIo->lastStateTime = millis();
+  }
+  if (!analogChanged(value, state) || !publishWritable()) {
+    return;
+  }
+  tryMqttPublish(analogIo->mqttPublisher, "analog", value, state, millis() - lastAnalogPublish);
+  notifyIoEvent("analog", 0, value, state, millis() - lastAnalogPublish);
+  analogPublished = value;
+  analogPublishedState = state;
+  lastAnalogPublish = millis();
+  analogPublishes++;
+}
+
+/*
+ * Should the analog value be published? The value has to move outside the deadband or the threshold state has to change,
+ * heartbeat forces a publish regardless
+ */
+bool Sonny::analogChanged(int32_t value, uint8_t state) {
+  uint32_t heartbeat = settings->getSettingInteger(settingAnalogHeartbeat);
+  if (!analogPublishes || (heartbeat && (millis() - lastAnalogPublish >= heartbeat))) {
+    return true;
+  }
+  return (state != analogPublishedState) || (abs(value - analogPublished) > settings->getSettingInteger(settingAnalogDeadband));
+}
 
 #ifdef SONNY_P1
-  if (p1Serial->available()) {
-    uint8_t lineLength = p1Serial->readBytesUntil('\n', softSerialBuffer, SOFTSERIAL_BUFFERSIZE);
-    // Append \n and terminate string
-    softSerialBuffer[lineLength++] = '\n';
-    softSerialBuffer[lineLength] = 0x00;
-    // Start of telegram?
-    if (softSerialBuffer[0] == '/') {
-      p1CRC = 0;
-      p1CalculateCRC16(softSerialBuffer, lineLength);
-      memset(powerIn, 0x00, 7);
-      memset(powerOut, 0x00, 7);
-      memset(gasIn, 0x00, 10);
-      memset(gasTime, 0x00, 13);
-    } else if (softSerialBuffer[0] == '!') {
-      p1CalculateCRC16(softSerialBuffer, 1);
-      softSerialBuffer[5] = 0x00;
-      uint16_t telegramCRC = strtol((const char*)softSerialBuffer + 1, NULL, 16);
-      if (telegramCRC == p1CRC) {
-//        logFormatted(Logger::severityDebug, "CRC ok 0x%x, 0x%x\r\n", telegramCRC, p1CRC);
-        // publish telegram to MQTT
-        if (connectMQTT()) {
-          char payload[128];
-          StaticJsonBuffer<128> jsonBuffer;
-          JsonObject& root = jsonBuffer.createObject();
-          root["powerIn"] = powerIn;
-          root["powerOut"] = powerOut;
-          root["gasIn"] = gasIn;
-          root["gasTime"] = gasTime;
-          root.printTo(payload, sizeof(payload));
-          if (!p1Io->mqttPublisher->publish(payload)) {
-            logFormatted(Logger::severityWarning, "MQTT publish failed\r\n");
-          }
-        }
-      } else {
-//        logFormatted(Logger::severityDebug, "CRC not ok 0x%x, 0x%x\r\n", telegramCRC, p1CRC);
-      }
+/*
+ * Read and parse one line of a P1 telegram
+ */
+void Sonny::handleP1() {
+  uint8_t *line = p1Buffer;
+  uint16_t lineLength;
+  if (p1Uart->hasOverrun()) {
+    p1Overruns++;
+  }
+  if (p1Uart->hasRxError()) {
+    p1RxErrors++;
+  }
+  if (p1Raw && !p1RawOverflow) {
+    // Collect whole telegram for raw publishing, lines are appended
+    if (P1_BUFFERSIZE - p1TelegramLength < P1_LINE_MAX) {
+      p1RawOverflow = true;
     } else {
-      p1CalculateCRC16(softSerialBuffer, lineLength);
-      if (!strncmp((const char*)softSerialBuffer, "1-0:1.7.0", strlen("1-0:1.7.0"))) {
-        memcpy(powerIn, softSerialBuffer + 10, 6);
-      } else if (!strncmp((const char*)softSerialBuffer, "1-0:2.7.0", strlen("1-0:2.7.0"))) {
-        memcpy(powerOut, softSerialBuffer + 10, 6);
-      } else if (!strncmp((const char*)softSerialBuffer, "0-1:24.2.1", strlen("0-1:24.2.1"))) {
-        memcpy(gasTime, softSerialBuffer + 11, 12);
-        memcpy(gasIn, softSerialBuffer + 26, 9);
-      }
+      line += p1TelegramLength;
     }
   }
-#endif
-
-#ifdef SONNY_REMEHA
-  if ((millis() - lastRemeha) > remehaInterval) {
-    lastRemeha = millis();
-    // Query: 0252050602005303 
-    uint8_t query[] = {0x02, 0x52, 0x05, 0x06, 0x02, 0x00, 0x53, 0x03};
-    remehaSerial->write(query, 8);
-    delay(200);
-    
-    if (remehaSerial->available()) {
-      bool payloadValid = false;
-      uint16_t crc = 0xffff;
-      softSerialBuffer[0] = 0x00;
-      while (softSerialBuffer[0] != 0x02) {
-        softSerialBuffer[0] = remehaSerial->read();
+  lineLength = p1Serial->readBytesUntil('\n', line, P1_BUFFERSIZE - (line - p1Buffer) - 2);
+  // Append \n and terminate string
+  line[lineLength++] = '\n';
+  line[lineLength] = 0x00;
+  // Start of telegram?
+  if (line[0] == '/') {
+    if (line != p1Buffer) {
+      memmove(p1Buffer, line, lineLength + 1);
+      line = p1Buffer;
+    }
+    p1TelegramLength = lineLength;
+    p1RawOverflow = false;
+    p1CRC = 0;
+    p1CalculateCRC16(line, lineLength);
+    p1Present = 0;
+  } else if (line[0] == '!') {
+    char crcText[5];
+    p1CalculateCRC16(line, 1);
+    memcpy(crcText, line + 1, 4);
+    crcText[4] = 0x00;
+    uint16_t telegramCRC = strtol(crcText, NULL, 16);
+    if (telegramCRC == p1CRC) {
+//        logFormatted(Logger::severityDebug, F("CRC ok 0x%x, 0x%x\r\n"), telegramCRC, p1CRC);
+      if (p1Raw) {
+        if (p1RawOverflow) {
+          logFormatted(Logger::severityWarning, F("P1 telegram too large for raw publishing\r\n"));
+        } else if (!mqttPublishRaw(p1RawTopic, p1Buffer, p1TelegramLength + lineLength)) {
+          logFormatted(Logger::severityWarning, F("MQTT raw publish failed\r\n"));
+        }
       }
-      for (uint8_t i = 1; i < 64; i++) {
-        softSerialBuffer[i] = remehaSerial->read();
-        if ((i > 0) && (i < 62)) {
-          // Payload
-          crc = (crc << 8) ^ remehaCrcTable[((crc >> 8) ^ softSerialBuffer[i])];
+      memcpy(p1Checked, p1Obis, sizeof(p1Checked));
+      p1CheckedPresent = p1Present;
+      p1Values[P1_POWER_IN] = p1Obis[obisPowerIn];
+      p1Values[P1_POWER_OUT] = p1Obis[obisPowerOut];
+      p1Values[P1_GAS_IN] = p1Obis[obisGasIn];
+      p1Series[P1_POWER_IN]->addSample(p1Values[P1_POWER_IN]);
+      p1Series[P1_POWER_OUT]->addSample(p1Values[P1_POWER_OUT]);
+      if (lastP1Gas && (p1Values[P1_GAS_IN] >= lastP1Gas)) {
+        p1Series[P1_GAS_IN]->addSample(p1Values[P1_GAS_IN] - lastP1Gas);
+      }
+      lastP1Gas = p1Values[P1_GAS_IN];
+      if (!p1Changed()) {
+        return;
+      }
+      memcpy(p1Published, p1Values, sizeof(p1Values));
+      lastP1Publish = millis();
+      char payload[P1_PAYLOAD_SIZE];
+      JsonStream json(payload, sizeof(payload));
+      obisField field;
+      json.beginObject();
+      for (uint8_t i = 0; i < obisCount; i++) {
+        if (!p1FieldAvailable(i)) {
+          continue;
         }
-        if (i == 62) {
-          // CRC
-          if (((uint8_t*)&crc)[1] == softSerialBuffer[i]) {
-            payloadValid = true;
-          }
+        Obis::getField(i, &field);
+        json.key(field.name);
+        if (field.type == obisTimestamp) {
+          json.value((uint32_t)p1Obis[i]);
+        } else {
+          json.valueFixed(p1Obis[i], field.decimals);
         }
       }
-      if (payloadValid) {
-//        logFormatted(Logger::severityDebug, "CRC match\r\n");
-        // Parse
-        uint16_t temp;
-        temp = (*(softSerialBuffer + 21) << 8) + (*(softSerialBuffer + 22));
-        roomTemp = (float)temp/100;
-        temp = (*(softSerialBuffer + 27) << 8) + (*(softSerialBuffer + 28));
-        roomSetpoint = (float)temp/100;
-        if (connectMQTT()) {
-          char payload[128];
-          StaticJsonBuffer<128> jsonBuffer;
-          JsonObject& root = jsonBuffer.createObject();
-          root["roomTemp"] = roomTemp;
-          root["roomSetpoint"] = roomSetpoint;
-          root.printTo(payload, sizeof(payload));
-          if (!remehaIo->mqttPublisher->publish(payload)) {
-            logFormatted(Logger::severityWarning, "MQTT publish failed\r\n");
-          }
+      json.endObject();
+      json.flush();
+      if (json.overflow()) {
+        logFormatted(Logger::severityWarning, F("Too many P1 fields selected\r\n"));
+      }
+      if (eventListener) {
+        eventListener("p1", payload);
+      }
+      // publish telegram to MQTT
+      if (connectMQTT()) {
+        if (!p1Io->mqttPublisher->publish(payload)) {
+          logFormatted(Logger::severityWarning, F("MQTT publish failed\r\n"));
         }
-      } else {
-//        logFormatted(Logger::severityDebug, "CRC mismatch\r\n");
       }
+    } else {
+//        logFormatted(Logger::severityDebug, F("CRC not ok 0x%x, 0x%x\r\n"), telegramCRC, p1CRC);
+      p1CrcErrors++;
+    }
+  } else {
+    p1CalculateCRC16(line, lineLength);
+    int8_t index = -1;
+    while ((index = Obis::find((const char*)line, index + 1)) >= 0) {
+      if (Obis::parse((const char*)line, index, &p1Obis[index])) {
+        p1Present |= (1ULL << index);
+      }
+    }
+    if (line != p1Buffer) {
+      p1TelegramLength += lineLength;
+    }
+  }
+}
+
+/*
+ * Select registers to publish from comma separated field names, all when empty
+ */
+void Sonny::p1SelectFields(const char *list) {
+  const char *end;
+  int8_t index;
+  p1Selected = 0;
+  if (!*list) {
+    p1Selected = ~0ULL;
+    return;
+  }
+  while (*list) {
+    end = strchr(list, ',');
+    if (!end) {
+      end = list + strlen(list);
+    }
+    if ((index = Obis::findName(list, end - list)) >= 0) {
+      p1Selected |= (1ULL << index);
+    } else {
+      logFormatted(Logger::severityWarning, F("Unknown P1 field %.*s\r\n"), (int)(end - list), list);
+    }
+    list = (*end ? end + 1 : end);
+  }
+}
+
+/*
+ * Register is selected and was present in the current telegram
+ */
+bool Sonny::p1FieldAvailable(uint8_t index) {
+  return (p1Selected & p1Present & (1ULL << index));
+}
+
+/*
+ * Should the current telegram be published? Power has to move outside the absolute and percentage deadband,
+ * gas is a counter updated every few minutes so any change counts. Heartbeat forces a publish regardless
+ */
+bool Sonny::p1Changed() {
+  uint32_t elapsed = millis() - lastP1Publish;
+  uint32_t heartbeat = settings->getSettingInteger(settingP1Heartbeat);
+  int32_t deadband = settings->getSettingInteger(settingP1Deadband);
+  int32_t percentage = settings->getSettingInteger(settingP1DeadbandPercent);
+  int32_t delta;
+
+  if (!lastP1Publish || (heartbeat && (elapsed >= heartbeat))) {
+    return true;
+  }
+  if (elapsed < (uint32_t)settings->getSettingInteger(settingP1MinInterval)) {
+    return false;
+  }
+  for (uint8_t i = P1_POWER_IN; i <= P1_POWER_OUT; i++) {
+    delta = abs(p1Values[i] - p1Published[i]);
+    if ((delta > deadband) && (delta * 100 > percentage * abs(p1Published[i]))) {
+      return true;
     }
   }
+  return (p1Values[P1_GAS_IN] != p1Published[P1_GAS_IN]);
+}
 #endif
+
+#ifdef SONNY_REMEHA
+/*
+ * Start a cycle through all queries, responses are picked up by remehaReceive
+ */
+void Sonny::remehaQuery() {
+  if (remehaPending) {
+    logFormatted(Logger::severityWarning, F("Remeha cycle still running\r\n"));
+    return;
+  }
+  // Values of previous cycles are not current anymore, fields the heater doesn't answer stay missing
+  remehaDecoded = 0;
+  remehaQueryIndex = 0;
+  remehaSend();
 }
 
+/*
+ * Send current query of the cycle
+ */
+void Sonny::remehaSend() {
+  uint8_t query[REMEHA_QUERY_SIZE];
+  Remeha::getQuery(remehaQueryIndex, &remehaCurrentQuery);
+  Remeha::buildQuery(remehaQueryIndex, query);
+  while (remehaSerial->available()) {
+    remehaSerial->read();
+  }
+  remehaSerial->write(query, sizeof(query));
+  remehaQueryTime = millis();
+  remehaPending = true;
+}
+
+/*
+ * Is a complete response available or did the heater not respond in time?
+ */
+bool Sonny::remehaReady() {
+  return remehaPending && ((remehaSerial->available() >= remehaCurrentQuery.frameSize) || (millis() - remehaQueryTime > REMEHA_TIMEOUT));
+}
+
+/*
+ * Read and decode response, then send the next query of the cycle right away or publish when done
+ */
+void Sonny::remehaReceive() {
+  bool payloadValid = false;
+  uint8_t frameSize = remehaCurrentQuery.frameSize;
+  if (remehaSoftSerial->overflow()) {
+    remehaOverflows++;
+  }
+  // Skip to start of frame
+  while (remehaSerial->available() && (remehaSerial->peek() != 0x02)) {
+    remehaSerial->read();
+  }
+  if (remehaSerial->available() < frameSize) {
+    if (millis() - remehaQueryTime <= REMEHA_TIMEOUT) {
+      return;
+    }
+    logFormatted(Logger::severityWarning, F("Remeha %s response timeout\r\n"), remehaCurrentQuery.name);
+  } else {
+    for (uint8_t i = 0; i < frameSize; i++) {
+      remehaBuffer[i] = remehaSerial->read();
+    }
+    // Payload runs from after STX up to the CRC, of which the frame carries the high byte
+    payloadValid = ((remehaCalculateCRC(remehaBuffer + 1, frameSize - 3) >> 8) == remehaBuffer[frameSize - 2]);
+  }
+  if (payloadValid) {
+//        logFormatted(Logger::severityDebug, F("CRC match\r\n"));
+    for (uint8_t i = remehaCurrentQuery.firstField; i < remehaCurrentQuery.firstField + remehaCurrentQuery.fieldCount; i++) {
+      remehaValues[i] = Remeha::decode(remehaBuffer, i);
+      remehaDecoded |= (1UL << i);
+    }
+  } else {
+//        logFormatted(Logger::severityDebug, F("CRC mismatch\r\n"));
+    remehaCrcErrors++;
+  }
+  if (++remehaQueryIndex < Remeha::getQueryCount()) {
+    remehaSend();
+    return;
+  }
+  remehaPending = false;
+  remehaPublish();
+}
+
+/*
+ * Publish all decoded fields, the document exceeds the MQTT library's buffer so it's streamed
+ */
+void Sonny::remehaPublish() {
+  char payload[REMEHA_PAYLOAD_SIZE];
+  JsonStream json(payload, sizeof(payload));
+  remehaField field;
+  if (!remehaDecoded) {
+    return;
+  }
+  if (remehaDecoded & (1UL << remehaRoomTemp)) {
+    roomTempSeries->addSample(remehaValues[remehaRoomTemp]);
+  }
+  if (remehaDecoded & (1UL << remehaRoomSetpoint)) {
+    roomSetpointSeries->addSample(remehaValues[remehaRoomSetpoint]);
+  }
+  json.beginObject();
+  for (uint8_t i = 0; i < remehaFieldCount; i++) {
+    if (remehaDecoded & (1UL << i)) {
+      Remeha::getField(i, &field);
+      json.key(field.name);
+      json.valueFixed(remehaValues[i], field.decimals);
+    }
+  }
+  json.endObject();
+  json.flush();
+  if (eventListener) {
+    eventListener("remeha", payload);
+  }
+  if (!mqttPublishRaw(remehaIo->publishTopic, (const uint8_t *)payload, json.length())) {
+    logFormatted(Logger::severityWarning, F("MQTT publish failed\r\n"));
+  }
+}
+#endif
+
 /*
  * Calculate CRC16 for x^16 + x^15 + x^2 + 1
  */
@@ -534,6 +1075,19 @@ uint16_t Sonny::p1CalculateCRC16(uint8_t *buffer, uint16_t length) {
 }
 #endif
 
+#ifdef SONNY_REMEHA
+/*
+ * Calculate table driven CRC16 over Remeha payload
+ */
+uint16_t Sonny::remehaCalculateCRC(const uint8_t *buffer, uint16_t length) {
+  uint16_t crc = 0xffff;
+  for (uint16_t index = 0; index < length; index++) {
+    crc = (crc << 8) ^ remehaCrcTable[((crc >> 8) ^ buffer[index])];
+  }
+  return crc;
+}
+#endif
+
 /*
  * Check subscriptions
  */
@@ -543,16 +1097,19 @@ void Sonny::handleMQTT() {
     return;
   }
   Adafruit_MQTT_Subscribe *subscription;
-  while (subscription = mqtt->readSubscription(100)) {
+  while (subscription = mqtt->readSubscription(10)) {
+    if (subscription == historySubscriber) {
+      publishHistory((const char *)subscription->lastread);
+    }
     for (uint8_t i = 0; i < outputCount; i++) {
       if (subscription == outputs[i]->mqttSubscriber) {
-        logFormatted(Logger::severityDebug, "Received MQTT message \"%s\"\r\n", subscription->lastread);
+        logFormatted(Logger::severityDebug, F("Received MQTT message \"%s\"\r\n"), subscription->lastread);
         JsonObject& root = jsonBuffer.parseObject(subscription->lastread);
         if (!root.success()) {
-          logFormatted(Logger::severityWarning, "parseObject() failed\r\n");
+          logFormatted(Logger::severityWarning, F("parseObject() failed\r\n"));
         } else {
           const char* state = root["state"];
-          logFormatted(Logger::severityDebug, "State \"%s\"\r\n", state);
+          logFormatted(Logger::severityDebug, F("State \"%s\"\r\n"), state);
           int8_t value = 0;
           if (!strcasecmp(state, "false") || !strcasecmp(state, "off")) {
             value = 1;
@@ -563,9 +1120,106 @@ void Sonny::handleMQTT() {
     }
     writeAll();
   }
-  if ((millis() - lastPing) > pingInterval) {
+}
+
+/*
+ * Answer {"series":"powerIn","level":1,"count":12} with min/max/avg over the last count buckets of that level
+ */
+void Sonny::publishHistory(const char *request) {
+  StaticJsonBuffer<128> jsonBuffer;
+  JsonObject& root = jsonBuffer.parseObject(request);
+  if (!root.success()) {
+    logFormatted(Logger::severityWarning, F("parseObject() failed\r\n"));
+    return;
+  }
+  const char *name = root["series"];
+  Timeseries *requested = (name ? findSeries(name) : NULL);
+  uint8_t level = root["level"];
+  uint16_t count = root["count"];
+  timeseriesBucket summary;
+  char payload[128];
+  JsonStream json(payload, sizeof(payload));
+  if (!requested || !requested->getLevel(level)) {
+    logFormatted(Logger::severityWarning, F("Unknown series or level\r\n"));
+    return;
+  }
+  if (!count) {
+    count = 1;
+  }
+  json.beginObject();
+  json.key(F("series"));
+  json.value(requested->getName());
+  json.key(F("resolution"));
+  json.value((uint32_t)(requested->getLevel(level)->resolution / 1000));
+  json.key(F("count"));
+  json.value((uint32_t)count);
+  if (requested->summarize(level, count, &summary)) {
+    json.key(F("min"));
+    json.valueFixed(summary.min, requested->getDecimals());
+    json.key(F("max"));
+    json.valueFixed(summary.max, requested->getDecimals());
+    json.key(F("avg"));
+    json.valueFixed(summary.avg, requested->getDecimals());
+  }
+  json.endObject();
+  json.flush();
+  if (!historyPublisher->publish(payload)) {
+    logFormatted(Logger::severityWarning, F("MQTT publish failed\r\n"));
+  }
+}
+
+/*
+ * Keep MQTT connection alive
+ */
+void Sonny::mqttPing() {
+  if (connectMQTT()) {
     mqtt->ping(5);
-    lastPing = millis();
+  }
+}
+
+/*
+ * Publish free heap and usage per subsystem
+ */
+void Sonny::publishStats() {
+  char payload[STATS_PAYLOAD_SIZE];
+  JsonStream json(payload, sizeof(payload));
+  json.beginObject();
+  json.key(F("free"));
+  json.value((uint32_t)ESP.getFreeHeap());
+  json.key(F("maxBlock"));
+  json.value((uint32_t)ESP.getMaxFreeBlockSize());
+  json.key(F("setupFree"));
+  json.value(Heap::getSetupFree());
+#ifdef SONNY_P1
+  json.key(F("p1Overruns"));
+  json.value(p1Overruns);
+  json.key(F("p1RxErrors"));
+  json.value(p1RxErrors);
+  json.key(F("p1CrcErrors"));
+  json.value(p1CrcErrors);
+#endif
+#ifdef SONNY_REMEHA
+  json.key(F("remehaOverflows"));
+  json.value(remehaOverflows);
+  json.key(F("remehaCrcErrors"));
+  json.value(remehaCrcErrors);
+#endif
+  for (uint8_t i = 0; i < heapSubsystemCount; i++) {
+    const heapUsage *usage = Heap::getUsage(i);
+    json.key(Heap::getName(i));
+    json.beginObject();
+    json.key(F("current"));
+    json.value(usage->current);
+    json.key(F("peak"));
+    json.value(usage->peak);
+    json.key(F("allocations"));
+    json.value(usage->allocations - usage->setupAllocations);
+    json.endObject();
+  }
+  json.endObject();
+  json.flush();
+  if (!mqttPublishRaw(statsTopic, (const uint8_t *)payload, json.length())) {
+    logFormatted(Logger::severityWarning, F("MQTT publish failed\r\n"));
   }
 }
 
@@ -578,19 +1232,69 @@ bool Sonny::connectMQTT() {
     return true;
   }
   
-  logFormatted(Logger::severityInfo, "Connecting to MQTT...\r\n");
+  if (tlsClient && !tlsProbed) {
+    // Small buffers only work when the broker limits its records to fit
+    if (BearSSL::WiFiClientSecure::probeMaxFragmentLength(settings->getSettingString(settingMqttHost), settings->getSettingInteger(settingMqttPort), MQTT_TLS_RX_BUFFER)) {
+      tlsClient->setBufferSizes(MQTT_TLS_RX_BUFFER, MQTT_TLS_TX_BUFFER);
+    } else {
+      logFormatted(Logger::severityWarning, F("MQTT broker does not support smaller TLS fragments\r\n"));
+    }
+    tlsProbed = true;
+  }
+  logFormatted(Logger::severityInfo, F("Connecting to MQTT...\r\n"));
+  uint32_t start = millis();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  umm_free_heap_size_min_reset();
   if (!(ret = mqtt->connect())) {
-    logFormatted(Logger::severityInfo, "MQTT Connected\r\n");
+    connectTime = millis() - start;
+    connectPeak = freeHeap - umm_free_heap_size_min();
+    connectHeap = freeHeap - ESP.getFreeHeap();
+    connectCount++;
+    logFormatted(Logger::severityInfo, F("MQTT Connected in %u ms, %d bytes heap peak, %d bytes held\r\n"), connectTime, connectPeak, connectHeap);
     setLedState(0, true);
-    lastPing = millis();
   } else {
-    logFormatted(Logger::severityError, "%s\r\n", mqtt->connectErrorString(ret));
+    if (tlsClient) {
+      logFormatted(Logger::severityError, F("TLS error %d\r\n"), tlsClient->getLastSSLError());
+    }
+    logFormatted(Logger::severityError, F("%S\r\n"), mqtt->connectErrorString(ret));
     setLedDutyCycle(0, 75);
     mqtt->disconnect();
   }
   return false;
 }
 
+/*
+ * MQTT runs over TLS, used for buffer sizing and error reporting
+ */
+void Sonny::setTlsClient(BearSSL::WiFiClientSecure *client) {
+  tlsClient = client;
+}
+
+/*
+ * Duration (ms) of last connect, including TLS handshake
+ */
+uint32_t Sonny::getConnectTime() {
+  return connectTime;
+}
+
+/*
+ * Most heap in use during last connect, including the TLS handshake
+ */
+int32_t Sonny::getConnectPeak() {
+  return connectPeak;
+}
+
+/*
+ * Heap held by connection after last connect
+ */
+int32_t Sonny::getConnectHeap() {
+  return connectHeap;
+}
+
+uint16_t Sonny::getConnectCount() {
+  return connectCount;
+}
+
 /*
  * Direct access to output device
  */
@@ -598,6 +1302,21 @@ sonoffIO *Sonny::getOutputDevice(uint8_t index) {
   return outputs[index];
 }
 
+/*
+ * Switch output to state as published, so taking reportInverted into account. The change is published by handleIO()
+ */
+void Sonny::setOutputState(uint8_t index, bool state) {
+  writeOutput(index, state ^ outputs[index]->reportInverted);
+  writeAll();
+}
+
+/*
+ * State of output as published
+ */
+bool Sonny::getOutputState(uint8_t index) {
+  return readOutput(index) ^ outputs[index]->reportInverted;
+}
+
 /*
  * Direct access to input device
  */
@@ -610,32 +1329,87 @@ sonoffIO *Sonny::getInputDevice(uint8_t index) {
  * If state change is a triggered input it's previous state won't have been published.
  * Eg: button is pressed (not published), button is released after 1000 msec (published with deltatime 1000 msec)
  */
-void Sonny::tryMqttPublish(Adafruit_MQTT_Publish * publisher, bool value, bool state, int deltaTime) {
+void Sonny::tryMqttPublish(Adafruit_MQTT_Publish * publisher, const char *type, int32_t value, bool state, int deltaTime) {
   char payload[128];
+  ioPayload(payload, sizeof(payload), type, value, state, deltaTime);
+  if (!publisher->publish(payload)) {
+    logFormatted(Logger::severityWarning, F("MQTT publish failed\r\n"));
+    setLedDutyCycle(0, 75);
+  }
+}
+
+/*
+ * Render IO state as JSON payload
+ */
+size_t Sonny::ioPayload(char *payload, size_t size, const char *type, int32_t value, bool state, int deltaTime) {
   // calculate minimum @ https://bblanchon.github.io/ArduinoJson/assistant/
   StaticJsonBuffer<128> jsonBuffer;
   JsonObject& root = jsonBuffer.createObject();
-  root["type"] = "bool";
+  root["type"] = type;
   root["value"] = value;
   root["state"] = state ? "on" : "off";
   root["deltaTime"] = deltaTime;
-  root.printTo(payload, sizeof(payload));  
-  if (!publisher->publish(payload)) {
-    logFormatted(Logger::severityWarning, "MQTT publish failed\r\n");
-    setLedDutyCycle(0, 75);
+  return root.printTo(payload, size);
+}
+
+/*
+ * Publish QoS 0 message written straight to the connection in chunks, for payloads larger than the MQTT library's buffer
+ */
+bool Sonny::mqttPublishRaw(const char *topic, const uint8_t *payload, uint16_t length) {
+  uint8_t header[7];
+  uint8_t headerLength = 1;
+  uint16_t topicLength = strlen(topic);
+  uint32_t remaining = 2 + topicLength + length;
+  if (!connectMQTT()) {
+    return false;
+  }
+  header[0] = 0x30; // PUBLISH, QoS 0
+  do {
+    header[headerLength] = remaining & 0x7F;
+    remaining >>= 7;
+    if (remaining) {
+      header[headerLength] |= 0x80;
+    }
+    headerLength++;
+  } while (remaining);
+  header[headerLength++] = topicLength >> 8;
+  header[headerLength++] = topicLength & 0xFF;
+  // Skip instead of blocking the loop behind a stalled broker
+  if ((uint32_t)wifiClient->availableForWrite() < min((uint32_t)(headerLength + topicLength + length), (uint32_t)MQTT_RAW_SPACE)) {
+    return false;
+  }
+  if ((wifiClient->write(header, headerLength) != headerLength) || (wifiClient->write((const uint8_t *)topic, topicLength) != topicLength)) {
+    mqttDropRaw();
+    return false;
+  }
+  for (uint16_t offset = 0; offset < length; offset += MQTT_RAW_CHUNK) {
+    uint16_t chunk = min((uint16_t)(length - offset), (uint16_t)MQTT_RAW_CHUNK);
+    if (wifiClient->write(payload + offset, chunk) != chunk) {
+      mqttDropRaw();
+      return false;
+    }
   }
+  return true;
+}
+
+/*
+ * A partial PUBLISH misframes everything after it, so drop the connection and let connectMQTT() start clean
+ */
+void Sonny::mqttDropRaw() {
+  logFormatted(Logger::severityWarning, F("MQTT raw publish cut short, reconnecting\r\n"));
+  wifiClient->stop();
 }
 
 /*
  * Set up for Sonoff S20 and certain other boards
  */
-SonnyS20::SonnyS20(WiFiClient *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 1, 1, 1) {
+SonnyS20::SonnyS20(Client *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 1, 1, 1) {
   loggerCount = 2;
-  loggers = (Logger**)malloc(sizeof(Logger*) * loggerCount);
-  loggers[0] = new SerialLogger(115200);
+  loggers = (Logger**)Heap::allocate(heapLogger, sizeof(Logger*) * loggerCount);
+  loggers[0] = new SerialLogger(&LOG_SERIAL, 115200);
   loggers[1] = new UdpLogger(LUMBERLOG_HOST, 12345);
 
-  logFormatted(Logger::severityInfo, "Setup Sonoff S20\r\n");
+  logFormatted(Logger::severityInfo, F("Setup Sonoff S20\r\n"));
   addInputDevice(0, 0);                 // button
   setInputTrigger(0, 0, (void*)Sonny::toggleOutputTrigger);
   setInputTrigger(0, 3, (void*)Sonny::resetConfigTrigger);
@@ -647,12 +1421,12 @@ SonnyS20::SonnyS20(WiFiClient *wifiClient, SettingsManager *settings) : Sonny(wi
 /*
  * Set up for Sonoff dual (IO devices above index 4 are ESP pins)
  */
-SonnyDual::SonnyDual(WiFiClient *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 4, 4, 1) {
+SonnyDual::SonnyDual(Client *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 4, 4, 1) {
   loggerCount = 1;
-  loggers = (Logger**)malloc(sizeof(Logger*) * loggerCount);
+  loggers = (Logger**)Heap::allocate(heapLogger, sizeof(Logger*) * loggerCount);
   loggers[0] = new UdpLogger(LUMBERLOG_HOST, 12345);
   
-  logFormatted(Logger::severityInfo, "Setup Sonoff Dual\r\n");
+  logFormatted(Logger::severityInfo, F("Setup Sonoff Dual\r\n"));
   addInputDevice(0, 1);                 // button0
   addInputDevice(1, 2);                 // button1
   addInputDevice(2, 4);                 // button2
@@ -695,6 +1469,14 @@ void SonnyDual::setupOutput(uint8_t index) {
   }
 }
 
+/*
+ * Also route co-processor link through capture
+ */
+void SonnyDual::setupCapture(Capture *capture) {
+  Sonny::setupCapture(capture);
+  dualSerial = capture->wrap(dualSerial, captureDual);
+}
+
 /*
  * Read non ESP IO devices
  */
@@ -703,12 +1485,12 @@ void SonnyDual::readAll() {
   // 0xA0, 0xf5, 0x00, 0xA1 - stuck
   // 0xA0, 0xf6, 0x00, 0xA1 - unstuck
   uint8_t input = 0;
-  if (Serial.available() == 4) {
-    input = Serial.read();
+  if (dualSerial->available() == 4) {
+    input = dualSerial->read();
     if (input == 0xA0) { // start of command
-      input = Serial.read();
+      input = dualSerial->read();
       if (input == 0x00 || input == 0x04) { // button message / relay status
-        input = Serial.read();
+        input = dualSerial->read();
         for (uint8_t i = 0; i < inputCount; i++) {
           if (inputs[i]->pin & input) {
             inputs[i]->currentState = 1;
@@ -719,30 +1501,40 @@ void SonnyDual::readAll() {
           }
         }
       } else if (input == 0xF5) { // stuck button
-        logFormatted(Logger::severityInfo, "Button stuck\r\n");
+        logFormatted(Logger::severityInfo, F("Button stuck\r\n"));
         if (stuckTriggers[0]) {
           stuckTriggers[0](0);
         }
-        input = Serial.read();
+        input = dualSerial->read();
       } else if (input == 0xF6) { // unstuck button
-        logFormatted(Logger::severityInfo, "Button unstuck\r\n");
+        logFormatted(Logger::severityInfo, F("Button unstuck\r\n"));
         if (stuckTriggers[1]) {
           stuckTriggers[1](1);
         }
-        input = Serial.read();
+        input = dualSerial->read();
       } else {
-        logFormatted(Logger::severityWarning, "Unexpected value for offset 1: 0x%x\r\n", input);
-        input = Serial.read();
-        logFormatted(Logger::severityWarning, "Unexpected value for offset 2: 0x%x\r\n", input);
+        logFormatted(Logger::severityWarning, F("Unexpected value for offset 1: 0x%x\r\n"), input);
+        input = dualSerial->read();
+        logFormatted(Logger::severityWarning, F("Unexpected value for offset 2: 0x%x\r\n"), input);
       }
-      input = Serial.read();
+      input = dualSerial->read();
       if (input != 0xA1) {
-        logFormatted(Logger::severityWarning, "Unexpected value for offset 3: 0x%x\r\n", input);
+        logFormatted(Logger::severityWarning, F("Unexpected value for offset 3: 0x%x\r\n"), input);
       }
     }
   }
 }
 
+/*
+ * Inputs of the co-processor are no ESP pins
+ */
+int8_t SonnyDual::getInputPin(uint8_t index) {
+  if (index >= 4) {
+    return Sonny::getInputPin(index);
+  }
+  return -1;
+}
+
 /*
  * Return inputs
  */
@@ -787,30 +1579,27 @@ void SonnyDual::writeAll() {
       bitfield += (1 << i);
     }
   }
-  Serial.write(0xa0);
-  Serial.write(0x04);
-  Serial.write(bitfield);
-  Serial.write(0xa1);
+  dualSerial->write(0xa0);
+  dualSerial->write(0x04);
+  dualSerial->write(bitfield);
+  dualSerial->write(0xa1);
 }
 
 /*
  * Set up for generic ESP8266 devices
  */
-#ifdef defined(SONNY_P1) || defined(SONNY_REMEHA)
-SonnyEsp::SonnyEsp(WiFiClient *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 0, 0, 0) {
+#if defined(SONNY_P1) || defined(SONNY_REMEHA)
+SonnyEsp::SonnyEsp(Client *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 0, 0, 0) {
 #else
-SonnyEsp::SonnyEsp(WiFiClient *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 0, 1, 0) {
+SonnyEsp::SonnyEsp(Client *wifiClient, SettingsManager *settings) : Sonny(wifiClient, settings, 0, 1, 0) {
 #endif
   loggerCount = 2;
-  loggers = (Logger**)malloc(sizeof(Logger*) * loggerCount);
-  loggers[0] = new SerialLogger(115200);
+  loggers = (Logger**)Heap::allocate(heapLogger, sizeof(Logger*) * loggerCount);
+  loggers[0] = new SerialLogger(&LOG_SERIAL, 115200);
   loggers[1] = new UdpLogger(LUMBERLOG_HOST, 12345);
-#ifndef SONNY_P1
-  addOutputDevice(0, 4);               // relay
-#endif
-#ifdef SONNY_REMEHA
-
+#if !defined(SONNY_P1) && !defined(SONNY_REMEHA)
+  addOutputDevice(0, 4);               // relay, pin 4 receives Remeha otherwise
 #endif
-  logFormatted(Logger::severityInfo, "Setup generic ESP device without IO\r\n");
+  logFormatted(Logger::severityInfo, F("Setup generic ESP device without IO\r\n"));
 }
 
@@ -33,6 +33,7 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 
 //#define SONNY_P1
 #define SONNY_REMEHA
+//#define SONNY_BENCHMARK         // Hot function timings on /benchmark
 
 #if SONOFF_DEVICE == SONOFF_TOUCH
   #error Set board to ESP8285 and flash mode to DOUT, 1M 64K SPIFFS
@@ -48,13 +49,61 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "logger.h"
 #include "settingsmanager.h"
+#include "scheduler.h"
+#include "timeseries.h"
+#include "obis.h"
+#include "remeha.h"
+#include "capture.h"
+#include "heap.h"
+#include "eventqueue.h"
+#include "analog.h"
+
+#if defined(SONNY_P1) && (SONOFF_DEVICE != ESP_12S)
+  #error P1 is received by UART0 swapped to GPIO13, only an ESP-12S has that pin free
+#endif
 
-#if defined(SONNY_P1) || defined(SONNY_REMEHA)
+#ifdef SONNY_REMEHA
 #include <SoftwareSerial.h>
-#define SOFTSERIAL_BUFFERSIZE 1024
+#endif
+
+#ifdef SONNY_P1
+#define LOG_SERIAL       Serial1  // UART0 receives P1, log on the transmit only UART1 (GPIO2)
+#else
+#define LOG_SERIAL       Serial
+#endif
+
+#define SERIES_MAX       5      // Maximum amount of downsampled series
+#define MQTT_RAW_CHUNK   128    // Bytes handed to the client per write when streaming a raw publish
+#define MQTT_RAW_SPACE   256    // Free transmit space needed to start a raw publish, the rest follows as the broker acknowledges
+#define STATS_PAYLOAD_SIZE 640  // Published heap and serial statistics
+#define MQTT_TLS_RX_BUFFER 1024 // TLS receive buffer when the broker agrees to this maximum fragment length, 16k otherwise
+#define MQTT_TLS_TX_BUFFER 512  // TLS transmit buffer, larger publishes are split over several records
+#define MQTT_EVENT_SPACE 192    // Free transmit space needed to publish an IO event without waiting for the broker
+
+#ifdef SONNY_P1
+#define P1_BAUDRATE      115200
+#define P1_RX_BUFFER     1024   // UART receive ring, room for a whole telegram
+#define P1_BUFFERSIZE    1024   // Telegram collected for raw publishing, lines are parsed in place
+#define P1_PAYLOAD_SIZE  256    // Published P1 JSON, keep Adafruit_MQTT MAXBUFFERSIZE large enough for the selected fields
+#define P1_LINE_MAX      128    // Room kept for the next line when collecting a raw telegram
+#define P1_FIELDS        3      // Decoded values compared for change-only publishing
+#define P1_POWER_IN      0
+#define P1_POWER_OUT     1
+#define P1_GAS_IN        2
+#endif
+
+#ifdef SONNY_REMEHA
+#define REMEHA_BAUDRATE  9600
+#define REMEHA_RX_PIN    4
+#define REMEHA_TX_PIN    5
+#define REMEHA_RX_BUFFER 256    // Software serial receive ring
+#define REMEHA_BUFFERSIZE 256   // Response frame being decoded, frame sizes are 8 bit
+#define REMEHA_TIMEOUT   200    // Time (ms) the heater gets to respond
+#define REMEHA_PAYLOAD_SIZE 512 // Published Remeha JSON
 #endif
 
 class Sonny;
+class Rules;
 
 /*
  * Contains information for an I/O, including MQTT pub/subs
@@ -83,7 +132,7 @@ typedef struct {
 
 class Sonny {
 public:
-  static Sonny *setupDevice(WiFiClient *wifiClient, SettingsManager *settings);
+  static Sonny *setupDevice(Client *wifiClient, SettingsManager *settings, Capture *capture = NULL);
   void addInputDevice(uint8_t index, uint8_t pin);
   void setInputTrigger(uint8_t index, uint8_t triggerIndex, void *trigger);
   void setInputTriggerPublishValue(uint8_t index, uint8_t triggerPublishState);
@@ -93,36 +142,77 @@ public:
   void setLedState(uint8_t index, bool state);
   void setLedDutyCycle(uint8_t index, uint8_t percentage);
   sonoffIO *getOutputDevice(uint8_t index);
+  void setOutputState(uint8_t index, bool state);
+  bool getOutputState(uint8_t index);
   sonoffIO *getInputDevice(uint8_t index);
   uint8_t getInputCount();
   uint8_t getOutputCount();
-
-#if defined(SONNY_P1) || defined(SONNY_REMEHA)
-  uint8_t softSerialBuffer[SOFTSERIAL_BUFFERSIZE];
-#endif
+  uint8_t getSeriesCount();
+  Timeseries *getSeries(uint8_t index);
+  Timeseries *findSeries(const char *name);
 
 #ifdef SONNY_P1
-  SoftwareSerial *p1Serial;
+  Stream *p1Serial;                     // P1 stream, possibly wrapped for capture
+  HardwareSerial *p1Uart;               // UART underneath it
+  uint8_t p1Buffer[P1_BUFFERSIZE];
   uint16_t p1CRC;
-  uint8_t powerIn[7];
-  uint8_t powerOut[7];
-  uint8_t gasIn[10];
-  uint8_t gasTime[13];
+  uint32_t p1CrcErrors = 0;             // Telegrams dropped for a CRC mismatch
+  uint32_t p1Overruns = 0;              // Times the UART receive ring overflowed
+  uint32_t p1RxErrors = 0;              // Times the UART saw framing or parity errors
+  int32_t p1Obis[obisCount] = {0};      // Decoded registers, scaled as in the OBIS table
+  uint64_t p1Present = 0;               // Bit per register seen in current telegram
+  int32_t p1Checked[obisCount] = {0};   // Registers of last telegram that passed its CRC, read by rules
+  uint64_t p1CheckedPresent = 0;        // Bit per register in p1Checked
+  uint64_t p1Selected = 0;              // Bit per register to publish
+  int32_t p1Values[P1_FIELDS];          // powerIn (W), powerOut (W), gasIn (dm3) of last complete telegram
+  int32_t p1Published[P1_FIELDS];       // Values last published
+  uint32_t lastP1Publish = 0;           // Time of last P1 publish
+  int32_t lastP1Gas = 0;                // Gas meter reading of previous telegram, for usage per sample
   
   uint16_t p1CalculateCRC16(uint8_t *buffer, uint16_t length);
+  uint16_t p1TelegramLength = 0;        // Bytes of current telegram collected in p1Buffer for raw publishing
+  bool p1RawOverflow = false;           // Current telegram did not fit in p1Buffer
+  void p1SelectFields(const char *list);
+  bool p1FieldAvailable(uint8_t index);
+  bool p1Changed();
+  void handleP1();
 #endif
 
 #ifdef SONNY_REMEHA
-  SoftwareSerial *remehaSerial;
+  Stream *remehaSerial;                 // Remeha link, possibly wrapped for capture
+  SoftwareSerial *remehaSoftSerial;     // Software serial underneath it
+  uint8_t remehaBuffer[REMEHA_BUFFERSIZE];
+  uint32_t remehaOverflows = 0;         // Times the software serial receive ring overflowed
   static uint16_t *remehaCrcTable;
-  float roomTemp;
-  float roomSetpoint;
+  static uint16_t remehaCalculateCRC(const uint8_t *buffer, uint16_t length);
+  uint32_t remehaCrcErrors = 0;         // Responses dropped for a CRC mismatch
+  int32_t remehaValues[remehaFieldCount] = {0}; // Decoded fields, scaled as in the Remeha table
+  uint32_t remehaDecoded = 0;           // Bit per field decoded from a valid response
+
+  void remehaQuery();
+  void remehaSend();
+  void remehaPublish();
+  bool remehaReady();
+  void remehaReceive();
 #endif
 
   void initialiseIO();
   void handleIO();
+  void handleAnalog();
+  AnalogInput *getAnalog();
+  uint32_t getAnalogPublishes();
 
   void handleMQTT();
+  void publishEvents();
+  void publishHistory(const char *request);
+  void mqttPing();
+  void publishStats();
+  void setTlsClient(BearSSL::WiFiClientSecure *client);
+  uint32_t getConnectTime();
+  int32_t getConnectPeak();
+  int32_t getConnectHeap();
+  uint16_t getConnectCount();
+  void registerTasks(Scheduler *scheduler);
 
   bool getSetupMode();
   void setSetupMode(bool value);
@@ -135,8 +225,15 @@ public:
   void resetConfig(uint8_t index);
   void countedOutput(uint8_t index);
 
-  void logFormatted(Logger::logSeverity severity, char *format, ...);
+  void logFormatted(Logger::logSeverity severity, const __FlashStringHelper *format, ...);
+  void setEventListener(void (*listener)(const char *event, const char *data));
+  void setRules(Rules *rules);
+  Rules *getRules();
+  EventQueue *getEventQueue();
+  uint32_t getMaxEventLatency();
+  uint32_t getResyncCount();
 
+  virtual int8_t getInputPin(uint8_t index);
   virtual uint8_t readInput(uint8_t index);
   virtual uint8_t readOutput(uint8_t index);
   virtual void writeOutput(uint8_t index, uint8_t value);
@@ -145,22 +242,53 @@ public:
 
   static Sonny* SingleSonny;
 
+  static void ioTask();
+  static void mqttTask();
+  static bool mqttReady();
+  static void publishTask();
+  static bool publishReady();
+  static void pingTask();
+  static void statsTask();
+  static void analogTask();
+  static bool analogReady();
+#ifdef SONNY_P1
+  static void p1Task();
+  static bool p1Ready();
+#endif
+#ifdef SONNY_REMEHA
+  static void remehaQueryTask();
+  static void remehaReceiveTask();
+  static bool remehaReadyTask();
+#endif
+
+#ifdef SONNY_BENCHMARK
+  friend class Benchmark;
+#endif
+
 protected:
-  Sonny(WiFiClient *wifiClient, SettingsManager *settings, uint8_t inputCount, uint8_t outputCount, uint8_t ledCount);
+  Sonny(Client *wifiClient, SettingsManager *settings, uint8_t inputCount, uint8_t outputCount, uint8_t ledCount);
   
   void addIoDevice(sonoffIO ** list, uint8_t index, uint8_t pin);
+  Timeseries *addSeries(const char *name, uint8_t decimals);
   bool connectMQTT();
-  void tryMqttPublish(Adafruit_MQTT_Publish * publisher, bool value, bool state, int deltaTime);
+  void tryMqttPublish(Adafruit_MQTT_Publish * publisher, const char *type, int32_t value, bool state, int deltaTime);
+  static size_t ioPayload(char *payload, size_t size, const char *type, int32_t value, bool state, int deltaTime);
+  bool mqttPublishRaw(const char *topic, const uint8_t *payload, uint16_t length);
+  void mqttDropRaw();
+  void notifyIoEvent(const char *event, uint8_t index, int32_t value, bool state, int deltaTime);
+  bool analogChanged(int32_t value, uint8_t state);
+  void queueIoEvent(uint8_t type, uint8_t index, uint8_t value, bool state, int deltaTime);
+  bool publishWritable();
   virtual void setupInput(uint8_t index);
   virtual void setupOutput(uint8_t index);
+  virtual void setupCapture(Capture *capture);
 
-  WiFiClient                    *wifiClient;
+  Client                        *wifiClient;                          // Connection to the broker, possibly wrapped for capture
   uint8_t                       inputCount = 0;                       // Amount of inputs
   uint8_t                       outputCount = 0;                      // Amount of outputs
   uint8_t                       outputCounter = 0;                    // Counter for bit toggled outputs
   uint8_t                       outputLimitCounter = 0;               // Limit for counter for bit toggled outputs
   uint8_t                       ledCount = 0;                         // Amount of LEDs (ie blinking outputs)
-  uint8_t                       ledCounter = 0;                       // Counter used for blinking pattern
   sonoffIO                      **inputs;                             // Array of input structs
   sonoffIO                      **outputs;                            // Array of output structs
   sonoffLED                     **leds;                               // Array of LED structs
@@ -170,41 +298,78 @@ protected:
   Logger                        **loggers;                            // Debug and logging
   uint8_t                       loggerCount = 0;                      // Amount of loggers
   uint32_t                      pingInterval = 180000;                // Time that has to elapse between pings
-  uint32_t                      lastPing;                             // Time of last ping
+  void                          (*eventListener)(const char *event, const char *data) = NULL; // Receives IO and telemetry changes, eg for server-sent events
+  Rules                         *rules = NULL;                        // Local automations evaluated by handleIO
+  EventQueue                    ioEvents;                             // IO changes from handleIO to the publish task
+  uint32_t                      resyncDropped = 0;                    // Dropped events already made up for by publishing all states
+  uint32_t                      resyncCount = 0;                      // Times all states were published after drops
+  uint32_t                      maxEventLatency = 0;                  // Longest time (ms) between detecting and publishing a change
+  Timeseries                    *series[SERIES_MAX];                  // Downsampled meter and heater values
+  uint8_t                       seriesCount = 0;                      // Amount of series
+  Adafruit_MQTT_Subscribe       *historySubscriber;                   // Requests for series summaries
+  Adafruit_MQTT_Publish         *historyPublisher;                    // Series summaries
+  char                          *statsTopic;                          // Topic for heap statistics
+  BearSSL::WiFiClientSecure     *tlsClient = NULL;                    // TLS transport underneath wifiClient, NULL for plain MQTT
+  bool                          tlsProbed = false;                    // Maximum fragment length negotiated with broker
+  uint32_t                      connectTime = 0;                      // Duration of last connect including TLS handshake (ms)
+  int32_t                       connectPeak = 0;                      // Most heap used during last connect
+  int32_t                       connectHeap = 0;                      // Heap held after last connect
+  uint16_t                      connectCount = 0;                     // Successful connects
+  uint32_t                      statsInterval = 60000;                // Time that has to elapse between statistics
+  AnalogInput                   *analog = NULL;                       // ADC sampler, NULL when analog_interval is 0
+  sonoffIO                      *analogIo;                            // IO struct for MQTT access, lastState holds the threshold state
+  int32_t                       analogPublished = 0;                  // Value last published
+  uint8_t                       analogPublishedState = 0;             // Threshold state last published
+  uint32_t                      lastAnalogPublish = 0;                // Time of last analog publish
+  uint32_t                      analogPublishes = 0;                  // Analog values published
 #ifdef SONNY_P1
   sonoffIO                      *p1Io;                                // IO struct for MQTT access
+  Timeseries                    *p1Series[P1_FIELDS];                 // powerIn, powerOut and gas usage per telegram
+  char                          *p1RawTopic;                          // Topic for raw telegrams
+  bool                          p1Raw;                                // Publish raw telegrams
 #endif
 #ifdef SONNY_REMEHA
   sonoffIO                      *remehaIo;                            // IO struct for MQTT access
-  uint32_t                      remehaInterval = 30000;               // Time that has to elapse between Remeha queries
-  uint32_t                      lastRemeha;                           // Time of last Remeha query
+  Timeseries                    *roomTempSeries;                      // Room temperature
+  Timeseries                    *roomSetpointSeries;                  // Room setpoint
+  uint32_t                      remehaInterval = 10000;               // Time that has to elapse between Remeha query cycles
+  uint32_t                      remehaQueryTime;                      // Time of last Remeha query
+  bool                          remehaPending = false;                // Waiting for Remeha response
+  uint8_t                       remehaQueryIndex = 0;                 // Query of current cycle being answered
+  remehaQueryType               remehaCurrentQuery;                   // Copy of that query from flash
 #endif
 };
 
 class SonnyS20 : public Sonny {
 public:
-  SonnyS20(WiFiClient *wifiClient, SettingsManager *settings);
+  SonnyS20(Client *wifiClient, SettingsManager *settings);
 };
 
 class SonnyDual : public Sonny {
 public:
-  SonnyDual(WiFiClient *wifiClient, SettingsManager *settings);
+  SonnyDual(Client *wifiClient, SettingsManager *settings);
 
+  int8_t getInputPin(uint8_t index);
   uint8_t readInput(uint8_t index);
   uint8_t readOutput(uint8_t index);
   void writeOutput(uint8_t index, uint8_t value);
   void readAll();
   void writeAll();
+#ifdef SONNY_BENCHMARK
+  friend class Benchmark;
+#endif
 
 protected:
   void setupInput(uint8_t index);
   void setupOutput(uint8_t index);
+  void setupCapture(Capture *capture);
   void (*stuckTriggers[2])(uint8_t index) = {0};  // Define firmware triggers for stuck/unstuck inputs
+  Stream *dualSerial = &Serial;                   // Link to co-processor
 };
 
 class SonnyEsp : public Sonny {
 public:
-  SonnyEsp(WiFiClient *wifiClient, SettingsManager *settings);
+  SonnyEsp(Client *wifiClient, SettingsManager *settings);
 };
 
 #endif // SONNY_H
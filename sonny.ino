@@ -16,64 +16,151 @@ along with sonny.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <ESP8266WiFi.h>
-#include <ESP8266WebServer.h>
+
+// https://github.com/me-no-dev/ESPAsyncTCP
+// https://github.com/me-no-dev/ESPAsyncWebServer
+#include <ESPAsyncTCP.h>
+#include <ESPAsyncWebServer.h>
 
 // https://github.com/esp8266/Arduino/tree/master/libraries/ArduinoOTA
 #include <ArduinoOTA.h>
 
 #include "sonny.h"
 #include "html.h"
+#include "assets.h"
+#include "jsonstream.h"
+#include "benchmark.h"
+#include "ota.h"
+#include "udpcontrol.h"
+#include "rules.h"
+
+#define WIFI_FAST_CONNECT_TIMEOUT 5000                 // Time allowed for connecting with cached BSSID and channel
+#define WWW_MAX_CONNECTIONS       3                    // Concurrent HTTP requests, more are answered with 503
+#define WWW_MAX_LISTENERS         4                    // Concurrent event stream listeners
+#define WWW_API_ITEMSIZE          192                  // Largest single element in /api/state
+#define SLEEP_POLL_INTERVAL       50                   // Longest idle time (ms) with readiness driven tasks when sleeping
+#define SLEEP_IO_INTERVAL         1000                 // Input polling period (ms) when sleeping, edges on the wake input poll right away
 
-ESP8266WebServer server(80);
+AsyncWebServer server(80);
+AsyncEventSource events("/events");
 WiFiClient client;
+BearSSL::WiFiClientSecure secureClient;
+BearSSL::Session mqttSession;                          // Lets reconnects resume instead of a full handshake
 
 Sonny *device;
 SettingsManager *settings;
+Scheduler scheduler;
+Capture *capture = NULL;                               // Serial and MQTT traffic recording or replay
+BearSSL::HashSHA256 otaHash;                           // Digest of update image as written
+OtaDigest otaDigest;                                   // Checks it against the digest appended to the image
+OtaProgress otaProgress;                               // Update throughput
+UdpControl *udpControl = NULL;                         // Output control without broker
+Rules *pendingRules = NULL;                            // Uploaded rules, to be installed by the rules task
+uint8_t wwwConnections = 0;                            // HTTP requests being answered
+bool settingsSavePending = false;                      // Settings posted, to be saved by the settings task
+#ifdef SONNY_BENCHMARK
+bool benchmarkPending = false;                         // Benchmark requested, to be run by the benchmark task
+#endif
+
+/*
+ * State of a /api/state response, rendered one element at a time when the connection has room
+ */
+typedef struct apiStateContext {
+  bool                      (*next)(struct apiStateContext *context); // Renders next element, false when done
+  uint8_t                   fields;                    // Requested sections
+  uint8_t                   section;                   // Section being rendered
+  uint16_t                  item;                      // Element within section
+  Timeseries                *series;                   // Series for /api/history
+  uint8_t                   level;                     // Resolution for /api/history
+  uint16_t                  pendingLength;             // Rendered bytes of current element
+  uint16_t                  pendingOffset;             // Bytes of current element already sent
+  JsonStream                json;
+  char                      pending[WWW_API_ITEMSIZE];
+} apiStateContext;
+
+typedef enum {
+  apiSectionStart = 0,
+  apiSectionInputs,
+  apiSectionOutputs,
+  apiSectionP1,
+  apiSectionRemeha,
+  apiSectionEnd,
+  apiSectionDone
+} apiStateSection;
+
+typedef enum {
+  apiHistoryStart = 0,
+  apiHistoryBuckets,
+  apiHistoryEnd,
+  apiHistoryDone
+} apiHistorySection;
 
 /*
  * WWW related functions
  */
-void wwwRoot() {
+
+/*
+ * Limit concurrent requests, requests are answered from network events and keep their connection until done
+ */
+bool wwwAdmit(AsyncWebServerRequest *request) {
+  if (wwwConnections >= WWW_MAX_CONNECTIONS) {
+    request->send(503, F("text/plain"), F("Busy"));
+    return false;
+  }
+  wwwConnections++;
+  request->onDisconnect([]() {
+    wwwConnections--;
+  });
+  return true;
+}
+
+void wwwRoot(AsyncWebServerRequest *request) {
   String page;
+  if (!wwwAdmit(request)) {
+    return;
+  }
   page += pageHeader("Sonny index");
   page += HtmlLink("", F("Configure"), F("configure")).toString();
   page += F("<br />"); 
   page += HtmlLink("", F("Control"), F("control")).toString();
+  page += F("<br />"); 
+  page += HtmlLink("", F("Status"), F("status")).toString();
   page += pageFooter();
-  server.send(200, F("text/html"), page);
+  Heap::sample(heapHtml, page.length());
+  request->send(200, F("text/html"), page);
 }
 
 /*
- * Configuration page, default when in AP mode
+ * Configuration page, default when in AP mode. Saving is left to the settings task to keep flash writes out of network events
  */
-void wwwConfigure() {
+void wwwConfigure(AsyncWebServerRequest *request) {
   String page;
   uint8_t i;
+  if (!wwwAdmit(request)) {
+    return;
+  }
   page += pageHeader("Configure Sonny");
-  switch (server.method()) {
+  switch (request->method()) {
     case HTTP_POST:
       for (i = 0; i < settingLast; i++) {
         if (settings->getSetting(i)->visible) {
           switch (settings->getSetting(i)->settingType) {
             case typeString:
             case typePassword:
-              settings->setSettingString((sonoffSettingIndex)i, (char *)server.arg(settings->getSetting(i)->settingName).c_str());
+              settings->setSettingString((sonoffSettingIndex)i, (char *)request->arg(settings->getSetting(i)->settingName).c_str());
             break;
             case typeBool:
 
             break;
             case typeInteger:
-              settings->setSettingInteger((sonoffSettingIndex)i, server.arg(settings->getSetting(i)->settingName).toInt());
+              settings->setSettingInteger((sonoffSettingIndex)i, request->arg(settings->getSetting(i)->settingName).toInt());
             break;
           }
         }
       }
       settings->setSettingBool(settingReset, false);
-      if (settings->saveSettings(false)) {
-        page += F("Settings saved<br />");
-      } else {
-        page += F("Error saving settings<br />");
-      }
+      settingsSavePending = true;
+      page += F("Saving settings<br />");
     case HTTP_GET:
       HtmlForm settingsForm("settings", F("configure"));
       for (i = 0; i < settingLast; i++) {
@@ -96,13 +183,32 @@ void wwwConfigure() {
     break;
   }
   page += pageFooter();
-  server.send(200, F("text/html"), page);
+  Heap::sample(heapHtml, page.length());
+  request->send(200, F("text/html"), page);
+}
+
+/*
+ * Once udp_key is set, switching outputs over HTTP takes it as key argument, otherwise it would bypass authenticated UDP control
+ */
+bool wwwControlAuthorised(AsyncWebServerRequest *request) {
+  const char *key = settings->getSettingString(settingUdpKey);
+  size_t length = strlen(key);
+  if (!length) {
+    return true;
+  }
+  const String &given = request->arg(F("key"));
+  // Look at every byte, so the time taken doesn't tell how much of the key matched
+  uint8_t difference = (given.length() != length);
+  for (size_t i = 0; i < given.length(); i++) {
+    difference |= given[i] ^ key[i % length];
+  }
+  return !difference;
 }
 
 /*
  * Page for overview of IO and status
  */
-void wwwControl() {
+void wwwControl(AsyncWebServerRequest *request) {
   String page;
   int8_t i;
 
@@ -112,10 +218,34 @@ void wwwControl() {
   const __FlashStringHelper * outputTableHeaders[] = {
     F("ID"), F("State"), F("Publication topic"), F("Subscription topic"), F("Last change (ms)")
   };
-  
+  const __FlashStringHelper * taskTableHeaders[] = {
+    F("Task"), F("Period (ms)"), F("Runs"), F("Overruns"), F("Max runtime (us)")
+  };
+  const __FlashStringHelper * captureTableHeaders[] = {
+    F("Channel"), F("Bytes"), F("Bytes/s")
+  };
+  const char *captureChannelNames[] = {
+    "p1", "remeha", "dual", "mqtt"
+  };
+
+  if (!wwwAdmit(request)) {
+    return;
+  }
   page += pageHeader("Control Sonny");
-  switch (server.method()) {
+  switch (request->method()) {
     case HTTP_POST:
+      // output=<index>&state=on|off[&key=<udp_key>], published by the IO task like any other change
+      if (!wwwControlAuthorised(request)) {
+        request->send(403, F("text/plain"), F("Wrong key"));
+        return;
+      }
+      i = request->arg(F("output")).toInt();
+      if (request->hasArg(F("output")) && (i >= 0) && (i < device->getOutputCount())) {
+        device->setOutputState(i, request->arg(F("state")) == "on");
+        page += "Output " + String(i, DEC) + " is " + (device->getOutputState(i) ? "on" : "off");
+      } else {
+        page += "Unknown output";
+      }
     break;
     case HTTP_GET:
       page += "<h2>Inputs</h2><p>";
@@ -131,19 +261,431 @@ void wwwControl() {
         outputTable.addRow({String(i, DEC), String(device->getOutputDevice(i)->lastState, DEC), String(device->getOutputDevice(i)->publishTopic), String(device->getOutputDevice(i)->mqttSubscriber->topic), String((millis() - device->getOutputDevice(i)->lastStateTime), DEC)});
       }
       page += outputTable.toString();
+
+      page += "<h2>Tasks</h2><p>";
+      HtmlTable taskTable("taskTable", 5, taskTableHeaders);
+      for (i = 0; i < scheduler.getTaskCount(); i++) {
+        schedulerTask *task = scheduler.getTask(i);
+        taskTable.addRow({String(task->name), String(task->period, DEC), String(task->runCount, DEC), String(task->overrunCount, DEC), String(task->maxRuntime, DEC)});
+      }
+      page += taskTable.toString();
+      page += "Idle: " + String(scheduler.getIdleTime(), DEC) + " ms of " + String(millis(), DEC) + " ms<br />";
+      page += "Wake latency: " + String(scheduler.getWakeLatency(), DEC) + " us, max " + String(scheduler.getMaxWakeLatency(), DEC) + " us over " + String(scheduler.getWakeCount(), DEC) + " wakes";
+      page += "<br />IO events: " + String(device->getEventQueue()->getCount(), DEC) + " queued, max " + String(device->getEventQueue()->getMaxCount(), DEC) + " of " + String(EVENT_QUEUE_SIZE, DEC) + ", " + String(device->getEventQueue()->getDropped(), DEC) + " dropped, " + String(device->getResyncCount(), DEC) + " resyncs, max latency " + String(device->getMaxEventLatency(), DEC) + " ms";
+      if (device->getRules()) {
+        Rules *rules = device->getRules();
+        page += "<br />Rules: " + String(rules->getRuleCount(), DEC) + " (" + String(rules->getLength(), DEC) + " bytes), " + String(rules->getPasses(), DEC) + " passes, " + String(rules->getActions(), DEC) + " actions, " + String(rules->getSkipped(), DEC) + " skipped for missing values, max " + String(rules->getMaxRuntime(), DEC) + " us";
+      }
+      if (device->getAnalog()) {
+        AnalogInput *analog = device->getAnalog();
+        page += "<br />Analog: " + String(analog->getValue(), DEC) + ", " + String(analog->getSamples(), DEC) + " samples every " + String(analog->getInterval(), DEC) + " ms, " + String(analog->getLate(), DEC) + " late, max " + String(analog->getMaxSampleTime(), DEC) + " us, " + String(device->getAnalogPublishes(), DEC) + " published";
+      }
+      if (udpControl) {
+        page += "<br />UDP control: " + String(udpControl->getAccepted(), DEC) + " accepted, " + String(udpControl->getRejected(), DEC) + " rejected";
+      }
+#ifdef SONNY_P1
+      page += "<br />P1 serial: " + String(device->p1Overruns, DEC) + " overruns, " + String(device->p1RxErrors, DEC) + " receive errors, " + String(device->p1CrcErrors, DEC) + " CRC errors";
+#endif
+#ifdef SONNY_REMEHA
+      page += "<br />Remeha serial: " + String(device->remehaOverflows, DEC) + " overflows, " + String(device->remehaCrcErrors, DEC) + " CRC errors";
+#endif
+      if (capture) {
+        uint32_t duration = capture->getDuration();
+        page += "<h2>Capture</h2><p>";
+        HtmlTable captureTable("captureTable", 3, captureTableHeaders);
+        for (i = 0; i < captureChannels; i++) {
+          captureTable.addRow({String(captureChannelNames[i]), String(capture->getBytes(i), DEC), String((uint32_t)((uint64_t)capture->getBytes(i) * 1000 / (duration ? duration : 1)), DEC)});
+        }
+        page += captureTable.toString();
+        page += String(capture->getMode() == captureModeRecord ? "Recorded " : "Replayed ") + String(duration, DEC) + " ms" + (capture->isFinished() ? ", finished" : "") + "<br />";
+        if (capture->getMode() == captureModeRecord) {
+          page += "Capture size: " + String(capture->getSize(), DEC) + " bytes<br />";
+        }
+      }
     break;
   }
   page += pageFooter();
-  server.send(200, F("text/html"), page);
+  Heap::sample(heapHtml, page.length());
+  request->send(200, F("text/html"), page);
 }
 
 /*
- * CSS page
+ * Page with heap usage per subsystem, allocations after setup point at steady state churn
  */
-void wwwStyle() {
+void wwwStatus(AsyncWebServerRequest *request) {
   String page;
-  page += F("label{display:inline-block;width:350px;}");
-  server.send(200, F("text/css"), page);
+  const __FlashStringHelper * heapTableHeaders[] = {
+    F("Subsystem"), F("Current (bytes)"), F("Peak (bytes)"), F("At setup (bytes)"), F("Allocations"), F("Allocations after setup")
+  };
+
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  page += pageHeader("Sonny status");
+  page += "<h2>Heap</h2><p>";
+  HtmlTable heapTable("heapTable", 6, heapTableHeaders);
+  for (uint8_t i = 0; i < heapSubsystemCount; i++) {
+    const heapUsage *usage = Heap::getUsage(i);
+    heapTable.addRow({String(Heap::getName(i)), String(usage->current, DEC), String(usage->peak, DEC), String(usage->setupCurrent, DEC), String(usage->allocations, DEC), String(usage->allocations - usage->setupAllocations, DEC)});
+  }
+  page += heapTable.toString();
+  page += "Free: " + String(ESP.getFreeHeap(), DEC) + " bytes, largest block " + String(ESP.getMaxFreeBlockSize(), DEC) + " bytes, fragmentation " + String(ESP.getHeapFragmentation(), DEC) + "%<br />";
+  page += "At setup: " + String(Heap::getSetupFree(), DEC) + " bytes free, largest block " + String(Heap::getSetupMaxBlock(), DEC) + " bytes";
+  page += "<h2>MQTT</h2><p>";
+  page += String(settings->getSettingInteger(settingMqttTls) ? "TLS" : "Plain") + ", " + String(device->getConnectCount(), DEC) + " connects, last took " + String(device->getConnectTime(), DEC) + " ms, peaked at " + String(device->getConnectPeak(), DEC) + " bytes and holds " + String(device->getConnectHeap(), DEC) + " bytes";
+  page += pageFooter();
+  Heap::sample(heapHtml, page.length());
+  request->send(200, F("text/html"), page);
+}
+
+/*
+ * Is field requested in comma separated fields= argument, all fields are sent when it's absent
+ */
+bool apiFieldSelected(const String &fields, const char *name) {
+  const char *match = fields.c_str();
+  uint8_t length = strlen(name);
+  if (fields.length() == 0) {
+    return true;
+  }
+  while ((match = strstr(match, name))) {
+    if (((match == fields.c_str()) || (match[-1] == ',')) && ((match[length] == ',') || (match[length] == 0x00))) {
+      return true;
+    }
+    match += length;
+  }
+  return false;
+}
+
+/*
+ * Single input or output as JSON object
+ */
+void apiStateIo(JsonStream &json, uint8_t index, sonoffIO *io, bool output) {
+  json.beginObject();
+  json.key(F("id"));
+  json.value((uint32_t)index);
+  json.key(F("value"));
+  json.value((uint32_t)io->lastState);
+  json.key(F("state"));
+  json.value((io->lastState ^ io->reportInverted) ? F("on") : F("off"));
+  json.key(F("topic"));
+  json.value(io->publishTopic);
+  if (output) {
+    json.key(F("subscribeTopic"));
+    json.value(io->mqttSubscriber->topic);
+  }
+  json.key(F("lastChange"));
+  json.value((uint32_t)(millis() - io->lastStateTime));
+  json.endObject();
+}
+
+/*
+ * Render next element of device state, false when document is complete
+ */
+bool apiStateNext(apiStateContext *context) {
+  JsonStream &json = context->json;
+  switch (context->section) {
+    case apiSectionStart:
+      json.beginObject();
+    break;
+    case apiSectionInputs:
+    case apiSectionOutputs: {
+      bool output = (context->section == apiSectionOutputs);
+      uint8_t count = (output ? device->getOutputCount() : device->getInputCount());
+      if (!(context->fields & (1 << context->section))) {
+        break;
+      }
+      if (context->item == 0) {
+        json.key(output ? F("outputs") : F("inputs"));
+        json.beginArray();
+      }
+      if (context->item < count) {
+        apiStateIo(json, context->item, (output ? device->getOutputDevice(context->item) : device->getInputDevice(context->item)), output);
+        context->item++;
+        return true;
+      }
+      json.endArray();
+    }
+    break;
+#ifdef SONNY_P1
+    case apiSectionP1:
+      if (!(context->fields & (1 << apiSectionP1))) {
+        break;
+      }
+      if (context->item == 0) {
+        json.key(F("p1"));
+        json.beginObject();
+      }
+      while ((context->item < obisCount) && !device->p1FieldAvailable(context->item)) {
+        context->item++;
+      }
+      if (context->item < obisCount) {
+        obisField field;
+        Obis::getField(context->item, &field);
+        json.key(field.name);
+        json.beginObject();
+        json.key(F("value"));
+        if (field.type == obisTimestamp) {
+          json.value((uint32_t)device->p1Obis[context->item]);
+        } else {
+          json.valueFixed(device->p1Obis[context->item], field.decimals);
+        }
+        json.key(F("unit"));
+        json.value(field.unit);
+        json.endObject();
+        context->item++;
+        return true;
+      }
+      json.endObject();
+    break;
+#endif
+#ifdef SONNY_REMEHA
+    case apiSectionRemeha:
+      if (!(context->fields & (1 << apiSectionRemeha))) {
+        break;
+      }
+      if (context->item == 0) {
+        json.key(F("remeha"));
+        json.beginObject();
+      }
+      while ((context->item < remehaFieldCount) && !(device->remehaDecoded & (1UL << context->item))) {
+        context->item++;
+      }
+      if (context->item < remehaFieldCount) {
+        remehaField field;
+        Remeha::getField(context->item, &field);
+        json.key(field.name);
+        json.beginObject();
+        json.key(F("value"));
+        json.valueFixed(device->remehaValues[context->item], field.decimals);
+        json.key(F("unit"));
+        json.value(field.unit);
+        json.endObject();
+        context->item++;
+        return true;
+      }
+      json.endObject();
+    break;
+#endif
+    case apiSectionEnd:
+      json.endObject();
+    break;
+    case apiSectionDone:
+      return false;
+  }
+  context->section++;
+  context->item = 0;
+  return true;
+}
+
+/*
+ * Fill response buffer from the context's renderer, one element at a time
+ */
+size_t apiFill(apiStateContext *context, uint8_t *buffer, size_t maxLength) {
+  size_t length = 0;
+  while (length < maxLength) {
+    if (context->pendingOffset == context->pendingLength) {
+      context->json.setBuffer(context->pending, sizeof(context->pending));
+      if (!context->next(context)) {
+        break;
+      }
+      context->pendingLength = context->json.length();
+      context->pendingOffset = 0;
+    }
+    size_t chunk = min((size_t)(context->pendingLength - context->pendingOffset), maxLength - length);
+    memcpy(buffer + length, context->pending + context->pendingOffset, chunk);
+    context->pendingOffset += chunk;
+    length += chunk;
+  }
+  return length;
+}
+
+/*
+ * Start streamed JSON response, context is freed with the request
+ */
+void apiSend(AsyncWebServerRequest *request, apiStateContext *context) {
+  context->section = 0;
+  context->item = 0;
+  context->pendingLength = 0;
+  context->pendingOffset = 0;
+  new (&context->json) JsonStream(context->pending, sizeof(context->pending));
+  request->_tempObject = context; // freed with request
+  Heap::sample(heapJson, sizeof(apiStateContext));
+
+  request->send(request->beginChunkedResponse(F("application/json"), [context](uint8_t *buffer, size_t maxLength, size_t index) -> size_t {
+    return apiFill(context, buffer, maxLength);
+  }));
+}
+
+/*
+ * Device state as JSON for machine clients, streamed element by element as the connection accepts data
+ */
+void wwwApiState(AsyncWebServerRequest *request) {
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  String fields = request->arg(F("fields"));
+  apiStateContext *context = (apiStateContext *)malloc(sizeof(apiStateContext));
+  if (!context) {
+    request->send(503, F("text/plain"), F("Out of memory"));
+    return;
+  }
+  context->next = apiStateNext;
+  context->fields = (apiFieldSelected(fields, "inputs") << apiSectionInputs) | (apiFieldSelected(fields, "outputs") << apiSectionOutputs) | (apiFieldSelected(fields, "p1") << apiSectionP1) | (apiFieldSelected(fields, "remeha") << apiSectionRemeha);
+  apiSend(request, context);
+}
+
+/*
+ * Render next element of series history, buckets oldest first as [min, max, avg] or null when empty
+ */
+bool apiHistoryNext(apiStateContext *context) {
+  JsonStream &json = context->json;
+  timeseriesLevel *level = context->series->getLevel(context->level);
+  uint8_t decimals = context->series->getDecimals();
+  switch (context->section) {
+    case apiHistoryStart:
+      context->series->advance();
+      context->item = level->count;
+      json.beginObject();
+      json.key(F("series"));
+      json.value(context->series->getName());
+      json.key(F("resolution"));
+      json.value((uint32_t)(level->resolution / 1000));
+      json.key(F("buckets"));
+      json.beginArray();
+    break;
+    case apiHistoryBuckets:
+      if (context->item > 0) {
+        timeseriesBucket *bucket = context->series->getBucket(context->level, --context->item);
+        if (!bucket || (bucket->avg == TIMESERIES_EMPTY)) {
+          json.valueNull();
+        } else {
+          json.beginArray();
+          json.valueFixed(bucket->min, decimals);
+          json.valueFixed(bucket->max, decimals);
+          json.valueFixed(bucket->avg, decimals);
+          json.endArray();
+        }
+        return true;
+      }
+    break;
+    case apiHistoryEnd:
+      json.endArray();
+      json.endObject();
+    break;
+    case apiHistoryDone:
+      return false;
+  }
+  context->section++;
+  return true;
+}
+
+/*
+ * Downsampled series as JSON, /api/history?series=powerIn&level=1 where level 0 is the finest resolution
+ */
+void wwwApiHistory(AsyncWebServerRequest *request) {
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  Timeseries *series = device->findSeries(request->arg(F("series")).c_str());
+  uint8_t level = request->arg(F("level")).toInt();
+  if (!series || !series->getLevel(level)) {
+    request->send(404, F("text/plain"), F("Unknown series or level"));
+    return;
+  }
+  apiStateContext *context = (apiStateContext *)malloc(sizeof(apiStateContext));
+  if (!context) {
+    request->send(503, F("text/plain"), F("Out of memory"));
+    return;
+  }
+  context->next = apiHistoryNext;
+  context->series = series;
+  context->level = level;
+  apiSend(request, context);
+}
+
+/*
+ * Download recording, recording stops so the file is complete
+ */
+void wwwCapture(AsyncWebServerRequest *request) {
+  if (!capture || (capture->getMode() != captureModeRecord)) {
+    request->send(404, F("text/plain"), F("Not recording"));
+    return;
+  }
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  capture->end();
+  request->send(SPIFFS, CAPTURE_FILE, F("application/octet-stream"), true);
+}
+
+/*
+ * Compiled rules uploaded with PUT /rules.bin, validated here and installed by the rules task
+ */
+void wwwRules(AsyncWebServerRequest *request) {
+  uint8_t *body = (uint8_t *)request->_tempObject;
+  if (!body) {
+    request->send(413, F("text/plain"), F("Rules missing or too large"));
+    return;
+  }
+  if (pendingRules) {
+    request->send(503, F("text/plain"), F("Busy"));
+    return;
+  }
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  // Rules switch outputs, so they take the same key as POST /control
+  if (!wwwControlAuthorised(request)) {
+    request->send(403, F("text/plain"), F("Wrong key"));
+    return;
+  }
+  Rules *rules = new Rules(device);
+  if (!rules->load(body, request->contentLength())) {
+    request->send(400, F("text/plain"), "Rules rejected at byte " + String(rules->getError(), DEC));
+    delete rules;
+    return;
+  }
+  pendingRules = rules;
+  request->send(200, F("text/plain"), String(rules->getRuleCount(), DEC) + " rules accepted");
+}
+
+/*
+ * Collect upload of /rules.bin, freed with the request
+ */
+void wwwRulesBody(AsyncWebServerRequest *request, uint8_t *data, size_t length, size_t index, size_t total) {
+  if (!index && (total <= sizeof(rulesHeader) + RULES_MAX_SIZE)) {
+    request->_tempObject = malloc(total);
+  }
+  if (request->_tempObject && (index + length <= total)) {
+    memcpy((uint8_t *)request->_tempObject + index, data, length);
+  }
+}
+
+/*
+ * Forward device events to server-sent event listeners, slow listeners lose messages instead of blocking
+ */
+void pushEvent(const char *event, const char *data) {
+  events.send(data, event);
+}
+
+/*
+ * Static file from flash, sent compressed and answered with 304 when the browser has it cached
+ */
+void wwwAsset(AsyncWebServerRequest *request, const staticAsset *asset) {
+  AsyncWebServerResponse *response;
+  String etag = FPSTR(asset->etag);
+  if (!wwwAdmit(request)) {
+    return;
+  }
+  if (request->hasHeader(F("If-None-Match")) && (request->getHeader(F("If-None-Match"))->value() == etag)) {
+    response = request->beginResponse(304);
+  } else {
+    response = request->beginResponse_P(200, String(FPSTR(asset->contentType)), asset->data, asset->length);
+    response->addHeader(F("Content-Encoding"), F("gzip"));
+  }
+  response->addHeader(F("ETag"), etag);
+  response->addHeader(F("Cache-Control"), F("max-age=86400"));
+  request->send(response);
 }
 
 /*
@@ -166,11 +708,115 @@ String pageFooter() {
   return page;
 }
 
+/*
+ * Wait for WiFi connection while handling IO, timeout 0 waits forever
+ */
+bool waitForWiFi(uint32_t timeout) {
+  uint32_t start = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (timeout && (millis() - start > timeout)) {
+      return false;
+    }
+    device->handleIO(); // Allow input triggers even when there is no connection
+    yield();
+  }
+  return true;
+}
+
+/*
+ * Parse BSSID in aa:bb:cc:dd:ee:ff notation
+ */
+bool parseBssid(const char *text, uint8_t *bssid) {
+  char *end;
+  for (uint8_t i = 0; i < WL_MAC_ADDR_LENGTH; i++) {
+    bssid[i] = strtol(text, &end, 16);
+    if ((end == text) || (*end != (i < WL_MAC_ADDR_LENGTH - 1 ? ':' : 0x00))) {
+      return false;
+    }
+    text = end + 1;
+  }
+  return true;
+}
+
+/*
+ * Connect to WiFi, try last known BSSID and channel first to skip the scan. The address always comes from DHCP
+ * (or the static configuration), reusing a lease without renewing it would keep the address after it expired
+ */
+void connectWiFi() {
+  uint32_t start = millis();
+  uint8_t bssid[WL_MAC_ADDR_LENGTH];
+  bool fastConnect = false;
+  IPAddress ip, gateway, subnet, dns;
+  bool staticConfig = ip.fromString(settings->getSettingString(settingStaticIp)) && gateway.fromString(settings->getSettingString(settingStaticGateway)) && subnet.fromString(settings->getSettingString(settingStaticSubnet));
+
+  WiFi.mode(WIFI_STA);
+  if (staticConfig) {
+    if (!dns.fromString(settings->getSettingString(settingStaticDns))) {
+      dns = gateway;
+    }
+    WiFi.config(ip, gateway, subnet, dns);
+  }
+  if (settings->getSettingInteger(settingWifiChannel) && parseBssid(settings->getSettingString(settingWifiBssid), bssid)) {
+    WiFi.begin(settings->getSettingString(settingSSID), settings->getSettingString(settingPSK), settings->getSettingInteger(settingWifiChannel), bssid);
+    fastConnect = waitForWiFi(WIFI_FAST_CONNECT_TIMEOUT);
+    if (!fastConnect) {
+      device->logFormatted(Logger::severityWarning, F("Fast connect to %s failed, scanning\r\n"), settings->getSettingString(settingWifiBssid));
+      WiFi.disconnect();
+    }
+  }
+  if (!fastConnect) {
+    WiFi.begin(settings->getSettingString(settingSSID), settings->getSettingString(settingPSK));
+    waitForWiFi(0);
+  }
+  device->logFormatted(Logger::severityInfo, F("Connected to %s in %lu ms (%S), boot to connected %lu ms\r\n"), settings->getSettingString(settingSSID), millis() - start, fastConnect ? F("fast") : F("scan"), millis());
+
+  // Remember access point for next boot, only written when changed
+  settings->setSettingString(settingWifiBssid, (char *)WiFi.BSSIDstr().c_str());
+  settings->setSettingInteger(settingWifiChannel, WiFi.channel());
+  settings->saveSettings(false);
+}
+
+/*
+ * Pin MQTT broker to stored fingerprint and keep session for resumption
+ */
+void configureTls() {
+  const char *fingerprint = settings->getSettingString(settingMqttHostFingerprint);
+  // Without fingerprint the handshake fails, there's no fallback to unauthenticated TLS
+  if (fingerprint[0]) {
+    secureClient.setFingerprint(fingerprint);
+  }
+  secureClient.setSession(&mqttSession);
+}
+
+/*
+ * Let WiFi stack sleep while the scheduler idles, inputs are then polled slowly and woken by edges on the wake input
+ */
+void configureSleep() {
+  int mode = settings->getSettingInteger(settingSleepMode);
+  int input = settings->getSettingInteger(settingWakeInput);
+  int8_t ioTask = scheduler.findTask("io");
+
+  if ((mode != 1) && (mode != 2)) {
+    return;
+  }
+  WiFi.setSleepMode(mode == 2 ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+  scheduler.setPollInterval(SLEEP_POLL_INTERVAL);
+  if ((input >= 0) && (input < device->getInputCount()) && (ioTask >= 0) && (device->getInputPin(input) >= 0)) {
+    scheduler.setPeriod(ioTask, SLEEP_IO_INTERVAL);
+    // Button pulls input low, with light sleep that also wakes the CPU
+    scheduler.setWakePin(device->getInputPin(input), ioTask, mode == 2);
+  }
+  device->logFormatted(Logger::severityInfo, F("Idle sleep mode %d, wake input %d\r\n"), mode, input);
+}
+
 /*
  * Setup device and libraries
  */
 void setup(void){
-  settings = new SettingsManager(F("/settings.dat"));
+  {
+    HeapScope scope(heapSettings);
+    settings = new SettingsManager(F("/settings.dat"), &LOG_SERIAL);
+  }
 //  Serial.begin(115200);
 //  Serial.println("");
 
@@ -185,10 +831,54 @@ void setup(void){
   settings->addSettingInteger(settingMqttPort, true, F("mqtt_port"), F("MQTT broker port"), 1883);
   settings->addSettingString(settingMqttUsername, true, F("mqtt_user"), F("MQTT username"), "", 32);
   settings->addSettingString(settingMqttPassword, true, F("mqtt_key"), F("MQTT password"), "", 64);
-  settings->addSettingString(settingMqttHostFingerprint, false, F("mqtt_host_fingerprint"), F("MQTT host SHA fingerprint"), "", 60);  // implemented later?
+  settings->addSettingString(settingMqttHostFingerprint, true, F("mqtt_host_fingerprint"), F("MQTT host SHA-1 fingerprint (AA:BB:...)"), "", 60);
+  settings->addSettingString(settingWifiBssid, false, F("wifi_bssid"), F("Last WiFi BSSID"), "", 18);
+  settings->addSettingInteger(settingWifiChannel, false, F("wifi_channel"), F("Last WiFi channel"), 0);
+  settings->addSettingString(settingStaticIp, true, F("static_ip"), F("Static IP address (empty for DHCP)"), "", 16);
+  settings->addSettingString(settingStaticGateway, true, F("static_gateway"), F("Static gateway"), "", 16);
+  settings->addSettingString(settingStaticSubnet, true, F("static_subnet"), F("Static subnet mask"), "", 16);
+  settings->addSettingString(settingStaticDns, true, F("static_dns"), F("Static DNS server"), "", 16);
+  settings->addSettingInteger(settingSleepMode, true, F("sleep_mode"), F("Idle sleep (0 none, 1 modem, 2 light)"), 0);
+  settings->addSettingInteger(settingWakeInput, true, F("wake_input"), F("Input waking from idle sleep (-1 for none)"), -1);
+  settings->addSettingInteger(settingP1Deadband, true, F("p1_deadband"), F("P1 power change to publish (W)"), 0);
+  settings->addSettingInteger(settingP1DeadbandPercent, true, F("p1_deadband_pct"), F("P1 power change to publish (%)"), 0);
+  settings->addSettingInteger(settingP1MinInterval, true, F("p1_min_interval"), F("Minimum time between P1 publishes (ms)"), 0);
+  settings->addSettingInteger(settingP1Heartbeat, true, F("p1_heartbeat"), F("Publish P1 without changes after (ms)"), 300000);
+  settings->addSettingString(settingP1Fields, true, F("p1_fields"), F("P1 fields to publish (empty for all)"), "powerIn,powerOut,gasIn,gasTime", 128);
+  settings->addSettingInteger(settingP1Raw, true, F("p1_raw"), F("Publish raw P1 telegrams (0 off, 1 on)"), 0);
+  settings->addSettingInteger(settingCaptureMode, true, F("capture"), F("Capture serial and MQTT (0 off, 1 record, 2 replay)"), 0);
+  settings->addSettingInteger(settingCaptureSpeed, true, F("capture_speed"), F("Replay speed factor (0 as fast as possible)"), 1);
+  settings->addSettingInteger(settingOtaVerify, true, F("ota_verify"), F("Only accept OTA images packed by tools/ota_pack.py (0 off, 1 on)"), 1);
+  settings->addSettingInteger(settingMqttTls, true, F("mqtt_tls"), F("MQTT over TLS (0 off, 1 on)"), 0);
+  settings->addSettingPassword(settingUdpKey, true, F("udp_key"), F("UDP control key (empty to disable)"), "", 32);
+  settings->addSettingInteger(settingUdpPort, true, F("udp_port"), F("UDP control port"), 4210);
+  settings->addSettingInteger(settingRules, true, F("rules"), F("Run rules from " RULES_FILE " (0 off, 1 on)"), 0);
+  settings->addSettingInteger(settingAnalogInterval, true, F("analog_interval"), F("Time between analog samples (ms, 0 off)"), 0);
+  settings->addSettingInteger(settingAnalogFilter, true, F("analog_filter"), F("Analog filter, samples weigh 1/2^n (0 to 8)"), 3);
+  settings->addSettingInteger(settingAnalogDeadband, true, F("analog_deadband"), F("Analog change to publish (0 to 4092)"), 16);
+  settings->addSettingInteger(settingAnalogOn, true, F("analog_on"), F("Analog state on at or above"), 2048);
+  settings->addSettingInteger(settingAnalogOff, true, F("analog_off"), F("Analog state off at or below"), 1843);
+  settings->addSettingInteger(settingAnalogHeartbeat, true, F("analog_heartbeat"), F("Publish analog without changes after (ms)"), 300000);
   settings->restoreSettings();
 //  Serial.println("Complete");
-  device = Sonny::setupDevice(&client, settings); // device specific configuration
+  Client *mqttClient = &client;
+  if (settings->getSettingInteger(settingMqttTls)) {
+    configureTls();
+    mqttClient = &secureClient;
+  }
+  if (settings->getSettingInteger(settingCaptureMode) != captureModeOff) {
+    capture = new Capture(settings->getSettingInteger(settingCaptureMode), settings->getSettingInteger(settingCaptureSpeed));
+    if (settings->mountFilesystem() && capture->begin()) {
+      mqttClient = capture->wrap(mqttClient, captureMqtt);
+    } else {
+      delete capture;
+      capture = NULL;
+    }
+  }
+  device = Sonny::setupDevice(mqttClient, settings, capture); // device specific configuration
+  if (settings->getSettingInteger(settingMqttTls)) {
+    device->setTlsClient(&secureClient);
+  }
   device->setLedDutyCycle(0, 50);           // show we're initialising
 
   if (settings->getSettingBool(settingReset)) {
@@ -199,13 +889,7 @@ void setup(void){
     device->setSetupMode(true);
   } else {
     // Setup STA mode
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(settings->getSettingString(settingSSID), settings->getSettingString(settingPSK));
-    // Wait for connection
-    while (WiFi.status() != WL_CONNECTED) {
-      device->handleIO(); // Allow input triggers even when there is no connection
-      yield();
-    }
+    connectWiFi();
 //    Serial.println("");
 //    Serial.print(F("Connected to "));
 //    Serial.println(settings->getSettingString(settingSSID));
@@ -218,61 +902,183 @@ void setup(void){
   } else {
     server.on("/configure", wwwConfigure);
     server.on("/control", wwwControl);
-    server.on("/style.css", wwwStyle);
+    server.on("/status", wwwStatus);
+    server.on("/api/state", HTTP_GET, wwwApiState);
+    server.on("/api/history", HTTP_GET, wwwApiHistory);
+    server.on(CAPTURE_FILE, HTTP_GET, wwwCapture);
+    server.on(RULES_FILE, HTTP_PUT, wwwRules, NULL, wwwRulesBody);
+#ifdef SONNY_BENCHMARK
+    server.on("/benchmark", HTTP_GET, [](AsyncWebServerRequest *request) {
+      benchmarkPending = true;
+      request->send(202, F("text/plain"), F("Benchmark started, results follow in " BENCHMARK_FILE));
+    });
+    server.on(BENCHMARK_FILE, HTTP_GET, [](AsyncWebServerRequest *request) {
+      request->send(SPIFFS, BENCHMARK_FILE, F("text/plain"));
+    });
+#endif
+    events.onConnect([](AsyncEventSourceClient *client) {
+      if (events.count() > WWW_MAX_LISTENERS) {
+        client->close();
+      }
+    });
+    server.addHandler(&events);
+    device->setEventListener(pushEvent);
     server.onNotFound(wwwRoot);
   }
+  for (uint8_t i = 0; i < STATIC_ASSET_COUNT; i++) {
+    const staticAsset *asset = &staticAssets[i];
+    String path = FPSTR(asset->path);
+    server.on(path.c_str(), HTTP_GET, [asset](AsyncWebServerRequest *request) {
+      wwwAsset(request, asset);
+    });
+  }
 
   server.begin();
 //  Serial.println(F("HTTP server started"));
 
   ArduinoOTA.setHostname(settings->getSettingString(settingHostname));
+  if (settings->getSettingInteger(settingOtaVerify)) {
+    // Compressed images are written as is and inflated by the bootloader, the digest covers what was sent
+    Update.installSignature(&otaHash, &otaDigest);
+  }
   ArduinoOTA.onStart([]() {
-    device->logFormatted(Logger::severityInfo, "Starting update OTA\r\n");
+    otaProgress.start();
+    device->logFormatted(Logger::severityInfo, F("Starting update OTA\r\n"));
   });
   ArduinoOTA.onEnd([]() {
-    device->logFormatted(Logger::severityInfo, "\nEnd of update OTA\r\n");
+    device->logFormatted(Logger::severityInfo, F("End of update OTA, %u bytes in %u ms (%u bytes/s)\r\n"), otaProgress.getBytes(), otaProgress.getDuration(), otaProgress.getThroughput());
   });
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    unsigned int percentage = (progress / (total / 100));
-    if (percentage == 100) {
-      device->logFormatted(Logger::severityInfo, "Updating: %d%%\r\n", percentage);
+    if (otaProgress.update(progress, total)) {
+      device->logFormatted(Logger::severityInfo, F("Updating: %d%%, %u bytes/s\r\n"), otaProgress.getPercentage(), otaProgress.getThroughput());
     }
   });
   ArduinoOTA.onError([](ota_error_t error) {
     device->setLedDutyCycle(0, 10);
     switch (error) {
       case OTA_AUTH_ERROR:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: Auth failed\r\n", error);
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: Auth failed\r\n"), error);
       break;
       case OTA_BEGIN_ERROR:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: Begin failed\r\n", error);
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: Begin failed\r\n"), error);
       break;
       case OTA_CONNECT_ERROR:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: Connect failed\r\n", error);
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: Connect failed\r\n"), error);
       break;
       case OTA_RECEIVE_ERROR:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: Receive failed\r\n", error);
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: Receive failed\r\n"), error);
       break;
       case OTA_END_ERROR:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: End failed\r\n", error);
+        // Also a digest mismatch, Update.getError() tells which
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: End failed (update error %u)\r\n"), error, Update.getError());
       break;
       default:
-        device->logFormatted(Logger::severityError, "OTA Error[%u]: Unknown failure\r\n", error);
+        device->logFormatted(Logger::severityError, F("OTA Error[%u]: Unknown failure\r\n"), error);
     }
   });
   ArduinoOTA.begin();
-  device->logFormatted(Logger::severityInfo, "%s ready\r\n", settings->getSettingString(settingHostname));
+
+  device->registerTasks(&scheduler);
+  if (!device->getSetupMode()) {
+    configureSleep();
+  }
+  scheduler.addTask("ota", []() {
+    ArduinoOTA.handle();
+  }, 100, 5000);
+  scheduler.addTask("settings", settingsTask, 0, 100000, []() {
+    return settingsSavePending;
+  });
+#ifdef SONNY_BENCHMARK
+  scheduler.addTask("benchmark", benchmarkTask, 0, 10000000, []() {
+    return benchmarkPending;
+  });
+#endif
+  if (settings->getSettingString(settingUdpKey)[0] && !device->getSetupMode()) {
+    udpControl = new UdpControl(device, settings->getSettingString(settingUdpKey), settings->getSettingInteger(settingUdpPort));
+    udpControl->begin();
+    scheduler.addTask("udp", []() {
+      udpControl->handle();
+    }, 0, 5000, []() {
+      return udpControl->ready();
+    });
+  }
+  if (!device->getSetupMode()) {
+    if (settings->getSettingInteger(settingRules)) {
+      loadRules();
+    }
+    scheduler.addTask("rules", rulesTask, 0, 100000, []() {
+      return (pendingRules != NULL);
+    });
+  }
+  if (capture) {
+    scheduler.addTask("capture", []() {
+      capture->flush(false);
+    }, CAPTURE_FLUSH_TIME, 20000);
+    device->logFormatted(Logger::severityInfo, F("Capture mode %d\r\n"), capture->getMode());
+  }
+  Heap::snapshot();
+  device->logFormatted(Logger::severityInfo, F("%s ready after %lu ms, %u bytes free\r\n"), settings->getSettingString(settingHostname), millis(), ESP.getFreeHeap());
 }
 
 /*
- * Main loop, handle incoming MQTT messages etc
+ * Save settings posted to /configure
  */
+void settingsTask() {
+  settingsSavePending = false;
+  if (!settings->saveSettings(false)) {
+    device->logFormatted(Logger::severityError, F("Error saving settings\r\n"));
+  }
+}
 
-void loop(void){
-  device->handleIO();
-#ifndef SONNY_P1
-  device->handleMQTT();
+/*
+ * Load saved rules, SPIFFS isn't mounted yet when settings came from RTC memory
+ */
+void loadRules() {
+  Rules *rules = new Rules(device);
+  if (settings->mountFilesystem() && rules->load(RULES_FILE)) {
+    device->setRules(rules);
+    device->logFormatted(Logger::severityInfo, F("%u rules loaded\r\n"), rules->getRuleCount());
+  } else {
+    device->logFormatted(Logger::severityError, F("Rules not loaded, error at byte %d\r\n"), rules->getError());
+    delete rules;
+  }
+}
+
+/*
+ * Install uploaded rules and save them so they are loaded again after a reset
+ */
+void rulesTask() {
+  Rules *rules = device->getRules();
+  device->setRules(pendingRules);
+  pendingRules = NULL;
+  delete rules;
+  rules = device->getRules();
+  if (!settings->mountFilesystem() || !rules->save(RULES_FILE)) {
+    device->logFormatted(Logger::severityError, F("Error saving rules\r\n"));
+  }
+  if (!settings->getSettingInteger(settingRules)) {
+    settings->setSettingInteger(settingRules, 1);
+    settingsSavePending = true;
+  }
+  device->logFormatted(Logger::severityInfo, F("%u rules installed\r\n"), rules->getRuleCount());
+}
+
+#ifdef SONNY_BENCHMARK
+/*
+ * Time hot functions, runs from a task so it doesn't interfere with requests being served
+ */
+void benchmarkTask() {
+  benchmarkPending = false;
+  Benchmark benchmark(device, settings);
+  if (!benchmark.run(BENCHMARK_FILE)) {
+    device->logFormatted(Logger::severityError, F("Error writing benchmark results\r\n"));
+  }
+}
 #endif
-  server.handleClient();
-  ArduinoOTA.handle();
+
+/*
+ * Main loop, run whichever tasks are due
+ */
+void loop(void){
+  scheduler.run();
 }
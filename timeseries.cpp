@@ -0,0 +1,162 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "timeseries.h"
+
+/*
+ * Reserve rings, resolutions (ms) and lengths are given per level, finest first
+ */
+Timeseries::Timeseries(const char *name, uint8_t decimals, const uint32_t *resolutions, const uint16_t *lengths) : name(name), decimals(decimals) {
+  for (uint8_t i = 0; i < TIMESERIES_LEVELS; i++) {
+    timeseriesLevel *level = &levels[i];
+    memset(level, 0x00, sizeof(timeseriesLevel));
+    level->resolution = resolutions[i];
+    level->length = lengths[i];
+    level->start = millis();
+    level->buckets = (timeseriesBucket*)malloc(sizeof(timeseriesBucket) * lengths[i]);
+    if (!level->buckets) {
+      level->length = 0;
+    }
+  }
+}
+
+/*
+ * Add sample to the open bucket of every level, clipped to what a bucket can hold
+ */
+void Timeseries::addSample(int32_t sample) {
+  int16_t value = constrain(sample, (int32_t)(INT16_MIN + 1), (int32_t)INT16_MAX);
+  advance();
+  for (uint8_t i = 0; i < TIMESERIES_LEVELS; i++) {
+    timeseriesLevel *level = &levels[i];
+    if (!level->samples || (value < level->min)) {
+      level->min = value;
+    }
+    if (!level->samples || (value > level->max)) {
+      level->max = value;
+    }
+    level->sum += value;
+    level->samples++;
+  }
+}
+
+/*
+ * Close buckets whose time has passed, gaps are filled with empty buckets
+ */
+void Timeseries::advance() {
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < TIMESERIES_LEVELS; i++) {
+    timeseriesLevel *level = &levels[i];
+    uint16_t closed = 0;
+    while ((now - level->start >= level->resolution) && (closed <= level->length)) {
+      closeBucket(level);
+      level->start += level->resolution;
+      closed++;
+    }
+    if (now - level->start >= level->resolution) {
+      // Longer gap than the ring covers, everything is empty by now
+      level->start = now - ((now - level->start) % level->resolution);
+    }
+  }
+}
+
+/*
+ * Store aggregate of open bucket in ring and start a new one
+ */
+void Timeseries::closeBucket(timeseriesLevel *level) {
+  if (!level->length) {
+    return;
+  }
+  timeseriesBucket *bucket = &level->buckets[level->head];
+  if (level->samples) {
+    bucket->min = level->min;
+    bucket->max = level->max;
+    bucket->avg = level->sum / level->samples;
+  } else {
+    bucket->min = 0;
+    bucket->max = 0;
+    bucket->avg = TIMESERIES_EMPTY;
+  }
+  level->head = (level->head + 1) % level->length;
+  if (level->count < level->length) {
+    level->count++;
+  }
+  level->sum = 0;
+  level->samples = 0;
+}
+
+/*
+ * Name used in API and MQTT
+ */
+const char *Timeseries::getName() {
+  return name;
+}
+
+/*
+ * Samples are scaled by 10^decimals
+ */
+uint8_t Timeseries::getDecimals() {
+  return decimals;
+}
+
+/*
+ * Direct access to level, eg for its resolution and bucket count
+ */
+timeseriesLevel *Timeseries::getLevel(uint8_t level) {
+  if (level >= TIMESERIES_LEVELS) {
+    return NULL;
+  }
+  return &levels[level];
+}
+
+/*
+ * Completed bucket, age 0 being the most recent, NULL when not available
+ */
+timeseriesBucket *Timeseries::getBucket(uint8_t level, uint16_t age) {
+  if ((level >= TIMESERIES_LEVELS) || (age >= levels[level].count)) {
+    return NULL;
+  }
+  timeseriesLevel *ring = &levels[level];
+  return &ring->buckets[(ring->head + ring->length - 1 - age) % ring->length];
+}
+
+/*
+ * Aggregate the most recent completed buckets of a level into one, false when none of them has samples
+ */
+bool Timeseries::summarize(uint8_t level, uint16_t count, timeseriesBucket *summary) {
+  int32_t sum = 0;
+  uint16_t filled = 0;
+  timeseriesBucket *bucket;
+  advance();
+  for (uint16_t age = 0; (age < count) && (bucket = getBucket(level, age)); age++) {
+    if (bucket->avg == TIMESERIES_EMPTY) {
+      continue;
+    }
+    if (!filled || (bucket->min < summary->min)) {
+      summary->min = bucket->min;
+    }
+    if (!filled || (bucket->max > summary->max)) {
+      summary->max = bucket->max;
+    }
+    sum += bucket->avg;
+    filled++;
+  }
+  if (!filled) {
+    return false;
+  }
+  summary->avg = sum / filled;
+  return true;
+}
@@ -0,0 +1,72 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <Arduino.h>
+
+#define TIMESERIES_LEVELS       3           // Resolutions kept per series
+#define TIMESERIES_EMPTY        INT16_MIN   // Average of bucket without samples
+
+/*
+ * Aggregate of all samples within one bucket
+ */
+typedef struct {
+  int16_t                   min;                                  // Lowest sample
+  int16_t                   max;                                  // Highest sample
+  int16_t                   avg;                                  // Average, TIMESERIES_EMPTY when there were no samples
+} timeseriesBucket;
+
+/*
+ * Ring of buckets at one resolution, plus the bucket being filled
+ */
+typedef struct {
+  uint32_t                  resolution;                           // Time covered by one bucket (ms)
+  uint16_t                  length;                               // Size of ring
+  uint16_t                  head;                                 // Next bucket to be written
+  uint16_t                  count;                                // Completed buckets in ring
+  uint32_t                  start;                                // Start time of open bucket (ms)
+  int16_t                   min;                                  // Lowest sample in open bucket
+  int16_t                   max;                                  // Highest sample in open bucket
+  int32_t                   sum;                                  // Sum of samples in open bucket
+  uint16_t                  samples;                              // Amount of samples in open bucket
+  timeseriesBucket          *buckets;                             // Ring storage
+} timeseriesLevel;
+
+/*
+ * Downsamples a value into min/max/avg rings at several resolutions, every sample updates all levels
+ * and a level closes its open bucket when its resolution has elapsed
+ */
+class Timeseries {
+public:
+  Timeseries(const char *name, uint8_t decimals, const uint32_t *resolutions, const uint16_t *lengths);
+  void addSample(int32_t value);
+  void advance();
+  const char *getName();
+  uint8_t getDecimals();
+  timeseriesLevel *getLevel(uint8_t level);
+  timeseriesBucket *getBucket(uint8_t level, uint16_t age);
+  bool summarize(uint8_t level, uint16_t count, timeseriesBucket *summary);
+private:
+  void closeBucket(timeseriesLevel *level);
+  const char                *name;
+  uint8_t                   decimals;                             // Samples are scaled by 10^decimals
+  timeseriesLevel           levels[TIMESERIES_LEVELS];
+};
+
+#endif // TIMESERIES_H
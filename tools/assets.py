@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Compress the static web assets in www/ into PROGMEM arrays in assets.h
+# Run from the sketch directory after changing anything in www/:
+#   python3 tools/assets.py
+
+import gzip
+import hashlib
+import os
+import re
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SOURCE = os.path.join(ROOT, 'www')
+TARGET = os.path.join(ROOT, 'assets.h')
+
+CONTENT_TYPES = {
+    '.css': 'text/css',
+    '.html': 'text/html',
+    '.js': 'application/javascript',
+    '.svg': 'image/svg+xml',
+    '.ico': 'image/x-icon',
+}
+
+HEADER = '''/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Generated by tools/assets.py from the files in www/, do not edit
+ */
+
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <Arduino.h>
+
+/*
+ * Gzip compressed static file in flash
+ */
+typedef struct {
+  const char                *path;                                // Request path
+  const char                *contentType;                         // MIME type
+  const char                *etag;                                // Strong ETag, quoted
+  const uint8_t             *data;                                // Gzip compressed content
+  uint16_t                  length;                               // Length of compressed content
+} staticAsset;
+
+'''
+
+
+def identifier(name):
+    parts = re.split(r'[^A-Za-z0-9]', name)
+    return 'asset' + ''.join(part.capitalize() for part in parts if part)
+
+
+def main():
+    assets = []
+    for name in sorted(os.listdir(SOURCE)):
+        extension = os.path.splitext(name)[1]
+        if extension not in CONTENT_TYPES:
+            continue
+        with open(os.path.join(SOURCE, name), 'rb') as source:
+            content = source.read()
+        data = gzip.compress(content, compresslevel=9, mtime=0)
+        etag = hashlib.sha256(content).hexdigest()[:16]
+        assets.append((name, identifier(name), CONTENT_TYPES[extension], etag, data))
+
+    with open(TARGET, 'w') as target:
+        target.write(HEADER)
+        for name, ident, contentType, etag, data in assets:
+            target.write('const char %sPath[] PROGMEM = "/%s";\n' % (ident, name))
+            target.write('const char %sType[] PROGMEM = "%s";\n' % (ident, contentType))
+            target.write('const char %sEtag[] PROGMEM = "\\"%s\\"";\n' % (ident, etag))
+            target.write('const uint8_t %sData[] PROGMEM = {' % ident)
+            for index, byte in enumerate(data):
+                target.write('%s0x%02x,' % ('\n  ' if index % 16 == 0 else ' ', byte))
+            target.write('\n};\n\n')
+        target.write('const staticAsset staticAssets[] = {\n')
+        for name, ident, contentType, etag, data in assets:
+            target.write('  {%sPath, %sType, %sEtag, %sData, %d},\n' % (ident, ident, ident, ident, len(data)))
+        target.write('};\n\n')
+        target.write('#define STATIC_ASSET_COUNT %d\n\n' % len(assets))
+        target.write('#endif // ASSETS_H\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Compare benchmark results of two builds, fetched from http://<host>/bench.txt
+# after requesting http://<host>/benchmark on a build with SONNY_BENCHMARK defined:
+#   python3 tools/bench.py before.txt after.txt
+
+import sys
+
+
+def load(path):
+    results = {}
+    with open(path) as source:
+        for line in source:
+            if line.startswith('#') or not line.strip():
+                continue
+            fields = line.split()
+            # Allocations per op were added later, older results lack them
+            allocations = int(fields[4]) if len(fields) > 4 else 0
+            results[fields[0]] = (int(fields[2]), int(fields[3]), allocations)
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        raise SystemExit('Usage: bench.py before.txt after.txt')
+    before = load(sys.argv[1])
+    after = load(sys.argv[2])
+    print('%-22s %10s %10s %8s %10s %10s' % ('benchmark', 'before ns', 'after ns', 'change', 'heap/op', 'allocs/op'))
+    for name in sorted(set(before) | set(after)):
+        if name not in before or name not in after:
+            print('%-22s only in %s' % (name, 'before' if name in before else 'after'))
+            continue
+        old, new = before[name][0], after[name][0]
+        change = (new - old) * 100.0 / old if old else 0.0
+        print('%-22s %10d %10d %+7.1f%% %4d -> %-4d %4d -> %d' % (name, old, new, change, before[name][1], after[name][1], before[name][2], after[name][2]))
+
+
+if __name__ == '__main__':
+    main()
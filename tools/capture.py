@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Inspect and build serial/MQTT captures as written by capture.cpp
+#   python3 tools/capture.py stats capture.bin
+#   python3 tools/capture.py extract --channel p1 capture.bin > telegrams.txt
+#   python3 tools/capture.py import --channel p1 --rate 11520 meter.txt > data/replay.bin
+# Put replay.bin in data/, upload it to SPIFFS and set capture to 2 to feed it to the firmware
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x50414353
+VERSION = 1
+HEADER = struct.Struct('<IHH')
+RECORD = struct.Struct('<IBBH')
+CHUNK = 64
+CHANNELS = ['p1', 'remeha', 'dual', 'mqtt']
+DIRECTIONS = ['rx', 'tx']
+
+
+def records(data):
+    magic, version, _ = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != VERSION:
+        raise SystemExit('Not a capture file')
+    offset = HEADER.size
+    while offset + RECORD.size <= len(data):
+        time, channel, direction, length = RECORD.unpack_from(data, offset)
+        offset += RECORD.size
+        yield time, channel, direction, data[offset:offset + length]
+        offset += length
+
+
+def stats(args):
+    totals = {}
+    for time, channel, direction, payload in records(args.file.read()):
+        key = (channel, direction)
+        first, last, count, size = totals.get(key, (time, time, 0, 0))
+        totals[key] = (first, time, count + 1, size + len(payload))
+    for (channel, direction), (first, last, count, size) in sorted(totals.items()):
+        duration = max(last - first, 1)
+        print('%-7s %s %8d bytes %6d records %8d ms %8.0f bytes/s' % (CHANNELS[channel], DIRECTIONS[direction], size, count, last - first, size * 1000.0 / duration))
+
+
+def extract(args):
+    channel = CHANNELS.index(args.channel)
+    direction = DIRECTIONS.index(args.direction)
+    out = sys.stdout.buffer
+    for _, recordChannel, recordDirection, payload in records(args.file.read()):
+        if recordChannel == channel and recordDirection == direction:
+            out.write(payload)
+
+
+def importRaw(args):
+    channel = CHANNELS.index(args.channel)
+    data = args.file.read()
+    out = sys.stdout.buffer
+    out.write(HEADER.pack(MAGIC, VERSION, 0))
+    for offset in range(0, len(data), CHUNK):
+        # Spread bytes over time as they would arrive at rate bytes/s, rate 0 sends all at once
+        time = offset * 1000 // args.rate if args.rate else 0
+        payload = data[offset:offset + CHUNK]
+        out.write(RECORD.pack(time, channel, 0, len(payload)))
+        out.write(payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sonny capture files')
+    commands = parser.add_subparsers(dest='command')
+    command = commands.add_parser('stats', help='bytes, records and throughput per channel')
+    command.add_argument('file', type=argparse.FileType('rb'))
+    command.set_defaults(handler=stats)
+    command = commands.add_parser('extract', help='raw bytes of one channel')
+    command.add_argument('--channel', choices=CHANNELS, required=True)
+    command.add_argument('--direction', choices=DIRECTIONS, default='rx')
+    command.add_argument('file', type=argparse.FileType('rb'))
+    command.set_defaults(handler=extract)
+    command = commands.add_parser('import', help='replay file from a raw dump')
+    command.add_argument('--channel', choices=CHANNELS, required=True)
+    command.add_argument('--rate', type=int, default=11520, help='bytes/s, 0 for no delays')
+    command.add_argument('file', type=argparse.FileType('rb'))
+    command.set_defaults(handler=importRaw)
+    args = parser.parse_args()
+    if not args.command:
+        parser.print_help()
+        return
+    args.handler(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Compress a sketch image and append its SHA-256 digest for OTA with ota_verify on:
+#   python3 tools/ota_pack.py pack sonny.ino.bin sonny.ota
+#   python3 tools/ota_pack.py verify sonny.ota
+#   espota.py -i <host> -f sonny.ota
+# The image is written to flash compressed and inflated by the bootloader. Digest and its 32 bit
+# length follow the compressed image, which is where Updater expects the signature of signed images
+
+import argparse
+import gzip
+import hashlib
+import struct
+import zlib
+
+DIGEST_SIZE = 32
+CHUNK = 1460                                # Roughly what arrives per TCP segment
+
+
+def pack(args):
+    image = args.image.read()
+    compressed = gzip.compress(image, compresslevel=9)
+    digest = hashlib.sha256(compressed).digest()
+    args.output.write(compressed + digest + struct.pack('<I', DIGEST_SIZE))
+    print('%d -> %d bytes (%.0f%%), sha256 %s' % (len(image), len(compressed), len(compressed) * 100.0 / len(image), digest.hex()))
+
+
+def verify(args):
+    packed = args.packed.read()
+    length, = struct.unpack('<I', packed[-4:])
+    if length != DIGEST_SIZE:
+        raise SystemExit('No digest appended')
+    compressed = packed[:-4 - DIGEST_SIZE]
+    if hashlib.sha256(compressed).digest() != packed[-4 - DIGEST_SIZE:-4]:
+        raise SystemExit('Digest mismatch')
+    # Inflate chunk by chunk like a transfer would arrive
+    inflater = zlib.decompressobj(16 + zlib.MAX_WBITS)
+    size = 0
+    try:
+        for offset in range(0, len(compressed), CHUNK):
+            size += len(inflater.decompress(compressed[offset:offset + CHUNK]))
+        size += len(inflater.flush())
+    except zlib.error as error:
+        raise SystemExit('Image does not inflate: %s' % error)
+    if not inflater.eof:
+        raise SystemExit('Truncated image')
+    print('ok, %d bytes inflating to %d bytes' % (len(compressed), size))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sonny OTA images')
+    commands = parser.add_subparsers(dest='command')
+    command = commands.add_parser('pack', help='compress image and append digest')
+    command.add_argument('image', type=argparse.FileType('rb'))
+    command.add_argument('output', type=argparse.FileType('wb'))
+    command.set_defaults(handler=pack)
+    command = commands.add_parser('verify', help='check digest and decompression of packed image')
+    command.add_argument('packed', type=argparse.FileType('rb'))
+    command.set_defaults(handler=verify)
+    args = parser.parse_args()
+    if not args.command:
+        parser.print_help()
+        return
+    args.handler(args)
+
+
+if __name__ == '__main__':
+    main()
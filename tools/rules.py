@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Compile rules for the on-device rule engine (rules.h) and upload them:
+#   python3 tools/rules.py compile rules.txt -o rules.bin
+#   python3 tools/rules.py upload sonny.local rules.bin [--key <udp_key>]
+#   python3 tools/rules.py dump rules.bin
+#
+# One rule per line, # starts a comment:
+#   when changed(2) and not input(2) and held(2) >= 2000: all off
+#   when edge(remeha.roomSetpoint > 21.5): set 0 on
+#   set 1 = p1.powerOut - p1.powerIn > 0.5
+#   when changed(0) and input(0): toggle 1
+# Values are input(n), output(n), changed(n), held(n) in ms, p1.<name> and remeha.<name> as published,
+# constants compared with a P1 or Remeha value are given in its unit and scaled like the firmware does.
+# edge(condition) is true only in the pass where the condition becomes true. Rules without when are
+# evaluated every pass and switch outputs back when something else changes them.
+
+import argparse
+import os
+import re
+import struct
+import sys
+import urllib.parse
+import urllib.request
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+MAGIC = 0x4C555253
+VERSION = 1
+MAX_SIZE = 1024
+EDGES = 32
+HEADER = struct.Struct('<IBBH')
+
+# Keep in sync with rulesOpcode
+OPCODES = ['rule', 'when', 'push', 'pushlong', 'input', 'output', 'changed', 'held', 'p1', 'remeha', 'edge',
+           'add', 'sub', 'eq', 'ne', 'lt', 'le', 'gt', 'ge', 'and', 'or', 'not', 'set', 'toggle', 'all']
+OP = {name: index + 1 for index, name in enumerate(OPCODES)}
+OPERAND = {'rule': 1, 'push': 1, 'pushlong': 4, 'input': 1, 'output': 1, 'changed': 1, 'held': 1,
+           'p1': 1, 'remeha': 1, 'edge': 1, 'set': 1, 'toggle': 1}
+COMPARISONS = {'==': 'eq', '!=': 'ne', '<': 'lt', '<=': 'le', '>': 'gt', '>=': 'ge'}
+TOKEN = re.compile(r'\s*(?:(\d+(?:\.\d+)?)|([A-Za-z_]\w*(?:\.\w+)?)|(==|!=|<=|>=|[<>+\-():,=]))')
+
+
+def fields(source, pattern):
+    # Names and decimals in table order, taken from the firmware so indexes can't drift
+    with open(os.path.join(ROOT, source)) as table:
+        return {match[0]: (index, int(match[1])) for index, match in enumerate(re.findall(pattern, table.read()))}
+
+
+P1_FIELDS = fields('obis.cpp', r'\{"[^"]*",\s*"(\w+)",\s*"[^"]*",\s*obis\w+,\s*(\d+),\s*\d+\}')
+REMEHA_FIELDS = fields('remeha.cpp', r'\{"(\w+)",\s*"[^"]*",\s*\d+,\s*\d+,\s*(?:true|false),\s*(\d+)\}')
+
+
+class Value:
+    # Either a constant not scaled yet or code leaving a value with a number of decimals on the stack
+    def __init__(self, code=b'', decimals=0, constant=None):
+        self.code = code
+        self.decimals = decimals
+        self.constant = constant
+
+
+def op(name, operand=None):
+    if operand is None:
+        return bytes([OP[name]])
+    if OPERAND[name] == 4:
+        return bytes([OP[name]]) + struct.pack('<i', operand)
+    return bytes([OP[name], operand & 0xff])
+
+
+def push(value):
+    if -128 <= value <= 127:
+        return op('push', value)
+    return op('pushlong', value)
+
+
+class Parser:
+    def __init__(self, line, edges):
+        self.tokens = []
+        position = 0
+        line = line.split('#')[0].rstrip()
+        while position < len(line):
+            match = TOKEN.match(line, position)
+            if not match:
+                raise SyntaxError('unexpected %r' % line[position:])
+            self.tokens.append(next(group for group in match.groups() if group is not None))
+            position = match.end()
+        self.position = 0
+        self.edges = edges
+
+    def peek(self):
+        return self.tokens[self.position] if self.position < len(self.tokens) else None
+
+    def take(self, expected=None):
+        token = self.peek()
+        if token is None or (expected is not None and token != expected):
+            raise SyntaxError('expected %s, got %s' % (expected or 'more', token or 'end of line'))
+        self.position += 1
+        return token
+
+    def number(self):
+        token = self.take()
+        if not token.isdigit():
+            raise SyntaxError('expected index, got %s' % token)
+        return int(token)
+
+    def emit(self, value, decimals=None):
+        # Code for value at the given scale, or its own scale when only truthiness matters
+        if value.constant is None:
+            if decimals is not None and value.decimals != decimals:
+                raise SyntaxError('values with %d and %d decimals can\'t be combined' % (value.decimals, decimals))
+            return value.code
+        return push(int(round(value.constant * 10 ** (decimals or 0))))
+
+    def combine(self, left, right, name, result):
+        if left.constant is not None and right.constant is not None:
+            constants = {'add': lambda a, b: a + b, 'sub': lambda a, b: a - b, 'eq': lambda a, b: a == b,
+                         'ne': lambda a, b: a != b, 'lt': lambda a, b: a < b, 'le': lambda a, b: a <= b,
+                         'gt': lambda a, b: a > b, 'ge': lambda a, b: a >= b}
+            return Value(constant=float(constants[name](left.constant, right.constant)))
+        decimals = left.decimals if left.constant is None else right.decimals
+        code = self.emit(left, decimals) + self.emit(right, decimals) + op(name)
+        return Value(code, decimals if result is None else result)
+
+    def expression(self):
+        value = self.conjunction()
+        while self.peek() == 'or':
+            self.take()
+            right = self.conjunction()
+            value = Value(self.emit(value) + self.emit(right) + op('or'))
+        return value
+
+    def conjunction(self):
+        value = self.negation()
+        while self.peek() == 'and':
+            self.take()
+            right = self.negation()
+            value = Value(self.emit(value) + self.emit(right) + op('and'))
+        return value
+
+    def negation(self):
+        if self.peek() == 'not':
+            self.take()
+            return Value(self.emit(self.negation()) + op('not'))
+        return self.comparison()
+
+    def comparison(self):
+        value = self.sum()
+        if self.peek() in COMPARISONS:
+            name = COMPARISONS[self.take()]
+            value = self.combine(value, self.sum(), name, 0)
+        return value
+
+    def sum(self):
+        value = self.atom()
+        while self.peek() in ('+', '-'):
+            name = 'add' if self.take() == '+' else 'sub'
+            value = self.combine(value, self.atom(), name, None)
+        return value
+
+    def atom(self):
+        token = self.take()
+        if token == '(':
+            value = self.expression()
+            self.take(')')
+            return value
+        if token == '-':
+            return Value(constant=-float(self.take()))
+        if re.match(r'\d', token):
+            return Value(constant=float(token))
+        if token in ('on', 'true'):
+            return Value(constant=1.0)
+        if token in ('off', 'false'):
+            return Value(constant=0.0)
+        if token == 'edge':
+            if len(self.edges) >= EDGES:
+                raise SyntaxError('more than %d edges' % EDGES)
+            self.take('(')
+            condition = self.emit(self.expression())
+            self.take(')')
+            self.edges.append(1)
+            return Value(condition + op('edge', len(self.edges) - 1))
+        if token in ('input', 'output', 'changed', 'held'):
+            self.take('(')
+            index = self.number()
+            self.take(')')
+            return Value(op(token, index))
+        for prefix, table, name in (('p1.', P1_FIELDS, 'p1'), ('remeha.', REMEHA_FIELDS, 'remeha')):
+            if token.startswith(prefix):
+                if token[len(prefix):] not in table:
+                    raise SyntaxError('unknown field %s' % token)
+                index, decimals = table[token[len(prefix):]]
+                return Value(op(name, index), decimals)
+        raise SyntaxError('unexpected %s' % token)
+
+    def action(self):
+        token = self.take()
+        if token == 'toggle':
+            return op('toggle', self.number())
+        if token not in ('set', 'all'):
+            raise SyntaxError('expected set, all or toggle, got %s' % token)
+        index = self.number() if token == 'set' else None
+        if self.peek() == '=':
+            self.take()
+        code = self.emit(self.expression())
+        return code + (op('set', index) if token == 'set' else op('all'))
+
+    def rule(self):
+        code = b''
+        if self.peek() == 'when':
+            self.take()
+            code += self.emit(self.expression()) + op('when')
+            self.take(':')
+        code += self.action()
+        while self.peek() == ',':
+            self.take()
+            code += self.action()
+        if self.peek() is not None:
+            raise SyntaxError('unexpected %s' % self.peek())
+        if len(code) > 255:
+            raise SyntaxError('rule too long')
+        return op('rule', len(code)) + code
+
+
+def compile_rules(path):
+    code = b''
+    edges = []
+    with open(path) as source:
+        for number, line in enumerate(source, 1):
+            if not line.split('#')[0].strip():
+                continue
+            try:
+                code += Parser(line, edges).rule()
+            except SyntaxError as error:
+                raise SystemExit('%s:%d: %s' % (path, number, error))
+    if len(code) > MAX_SIZE:
+        raise SystemExit('%d bytes of rules, the firmware takes %d' % (len(code), MAX_SIZE))
+    return HEADER.pack(MAGIC, VERSION, 0, len(code)) + code
+
+
+def dump(data):
+    magic, version, _, length = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or length != len(data) - HEADER.size:
+        raise SystemExit('Not a version %d rules file' % VERSION)
+    names = {'p1': {index: name for name, (index, _) in P1_FIELDS.items()},
+             'remeha': {index: name for name, (index, _) in REMEHA_FIELDS.items()}}
+    position = HEADER.size
+    while position < len(data):
+        opcode = data[position]
+        name = OPCODES[opcode - 1] if 1 <= opcode <= len(OPCODES) else '?%d' % opcode
+        size = OPERAND.get(name, 0)
+        operand = ''
+        if size == 4:
+            operand = ' %d' % struct.unpack_from('<i', data, position + 1)[0]
+        elif size == 1:
+            value = data[position + 1]
+            if name == 'push':
+                value = struct.unpack_from('<b', data, position + 1)[0]
+            operand = ' %s' % names.get(name, {}).get(value, value)
+        print('%5d  %s%s' % (position, name, operand))
+        position += 1 + size
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sonny rule compiler')
+    commands = parser.add_subparsers(dest='command', required=True)
+    compile_parser = commands.add_parser('compile', help='compile rules to bytecode')
+    compile_parser.add_argument('source')
+    compile_parser.add_argument('-o', '--output', default='rules.bin')
+    upload_parser = commands.add_parser('upload', help='install compiled rules on a device')
+    upload_parser.add_argument('host')
+    upload_parser.add_argument('file')
+    upload_parser.add_argument('--key', help='udp_key of the device, once set')
+    dump_parser = commands.add_parser('dump', help='disassemble compiled rules')
+    dump_parser.add_argument('file')
+    args = parser.parse_args()
+
+    if args.command == 'compile':
+        data = compile_rules(args.source)
+        with open(args.output, 'wb') as output:
+            output.write(data)
+        print('%d bytes of bytecode' % (len(data) - HEADER.size))
+    elif args.command == 'upload':
+        with open(args.file, 'rb') as source:
+            url = 'http://%s/rules.bin' % args.host
+            if args.key:
+                url += '?' + urllib.parse.urlencode({'key': args.key})
+            request = urllib.request.Request(url, data=source.read(), method='PUT')
+        try:
+            with urllib.request.urlopen(request) as response:
+                print(response.read().decode())
+        except urllib.error.HTTPError as error:
+            raise SystemExit(error.read().decode())
+    else:
+        with open(args.file, 'rb') as source:
+            dump(source.read())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# This file is part of sonny Copyright (C) 2017 Erik de Jong
+#
+# sonny is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sonny is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Switch outputs over UDP control (udp_key, udp_port), see udpcontrol.h for the datagrams:
+#   python3 tools/udp_control.py --key secret sonny.local state
+#   python3 tools/udp_control.py --key secret sonny.local set 0 on
+#   python3 tools/udp_control.py --key secret sonny.local toggle 1
+
+import argparse
+import hashlib
+import hmac
+import socket
+import struct
+import time
+
+MAGIC = 0x53
+MAC_SIZE = 16
+REPLY = 0x80
+COMMANDS = {'state': 0, 'set': 1, 'toggle': 2}
+STATUS = ['ok', 'unknown output', 'unknown command', 'nonce', 'replay']
+REQUEST = struct.Struct('<BBBBII')
+RESPONSE = struct.Struct('<BBBBIIII')
+
+
+def sign(key, data):
+    return hmac.new(key, data, hashlib.sha256).digest()[:MAC_SIZE]
+
+
+def exchange(sock, address, key, command, index, state, nonce, sequence):
+    request = REQUEST.pack(MAGIC, command, index, state, nonce, sequence)
+    start = time.monotonic()
+    sock.sendto(request + sign(key, request), address)
+    while True:
+        data, _ = sock.recvfrom(64)
+        if len(data) != RESPONSE.size + MAC_SIZE:
+            continue
+        body = data[:RESPONSE.size]
+        if not hmac.compare_digest(sign(key, body), data[RESPONSE.size:]):
+            raise SystemExit('Reply failed authentication')
+        magic, replyCommand, status, count, states, replyNonce, replySequence, accepted = RESPONSE.unpack(body)
+        if magic == MAGIC and replyCommand == command | REPLY and replySequence == sequence:
+            return status, count, states, replyNonce, accepted, (time.monotonic() - start) * 1000
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sonny UDP control')
+    parser.add_argument('--key', required=True)
+    parser.add_argument('--port', type=int, default=4210)
+    parser.add_argument('host')
+    parser.add_argument('command', choices=sorted(COMMANDS))
+    parser.add_argument('output', type=int, nargs='?', default=0)
+    parser.add_argument('state', choices=['on', 'off'], nargs='?', default='on')
+    args = parser.parse_args()
+    key = args.key.encode()
+    address = (socket.gethostbyname(args.host), args.port)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(1.0)
+    command = COMMANDS[args.command]
+    state = 1 if args.state == 'on' else 0
+    nonce = 0
+    sequence = 0
+    for attempt in range(3):
+        status, count, states, nonce, accepted, roundTrip = exchange(sock, address, key, command, args.output, state, nonce, sequence)
+        # First attempt learns the nonce and last accepted sequence of the current boot, another client may have
+        # used the next sequence meanwhile
+        if STATUS[status] not in ('nonce', 'replay'):
+            break
+        sequence = accepted + 1
+    print('%s in %.1f ms, outputs %s' % (STATUS[status], roundTrip, ' '.join('%d:%s' % (i, 'on' if states >> i & 1 else 'off') for i in range(count))))
+
+
+if __name__ == '__main__':
+    main()
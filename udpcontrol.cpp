@@ -0,0 +1,128 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "udpcontrol.h"
+
+UdpControl::UdpControl(Sonny *device, const char *key, uint16_t port) : device(device), port(port) {
+  br_hmac_key_init(&this->key, &br_sha256_vtable, key, strlen(key));
+  do {
+    nonce = ESP.random();
+  } while (!nonce);
+}
+
+/*
+ * Start listening
+ */
+void UdpControl::begin() {
+  udp.begin(port);
+}
+
+/*
+ * Has a datagram arrived?
+ */
+bool UdpControl::ready() {
+  packetSize = udp.parsePacket();
+  return (packetSize > 0);
+}
+
+/*
+ * Authenticate request, execute it and reply with resulting states. Datagrams that fail authentication get no reply
+ */
+void UdpControl::handle() {
+  udpControlRequest request;
+  udpControlReply reply;
+  uint8_t mac[UDP_CONTROL_MAC_SIZE];
+  if ((packetSize != sizeof(request)) || (udp.read((uint8_t *)&request, sizeof(request)) != sizeof(request))) {
+    rejected++;
+    return;
+  }
+  sign(&request, offsetof(udpControlRequest, mac), mac);
+  // Compare all bytes so timing doesn't tell how much of the MAC was right
+  uint8_t difference = 0;
+  for (uint8_t i = 0; i < UDP_CONTROL_MAC_SIZE; i++) {
+    difference |= mac[i] ^ request.mac[i];
+  }
+  if ((request.magic != UDP_CONTROL_MAGIC) || difference) {
+    rejected++;
+    return;
+  }
+  reply.status = udpStatusOk;
+  if (request.nonce != nonce) {
+    reply.status = udpStatusNonce;
+  } else if (request.sequence <= sequence) {
+    reply.status = udpStatusReplay;
+  } else {
+    sequence = request.sequence;
+    reply.status = execute(&request);
+    accepted++;
+  }
+  reply.magic = UDP_CONTROL_MAGIC;
+  reply.command = request.command | UDP_CONTROL_REPLY;
+  reply.outputCount = device->getOutputCount();
+  reply.states = 0;
+  for (uint8_t i = 0; (i < reply.outputCount) && (i < 32); i++) {
+    reply.states |= ((uint32_t)device->getOutputState(i) << i);
+  }
+  reply.nonce = nonce;
+  reply.sequence = request.sequence;
+  reply.accepted = sequence;
+  sign(&reply, offsetof(udpControlReply, mac), reply.mac);
+  udp.beginPacket(udp.remoteIP(), udp.remotePort());
+  udp.write((const uint8_t *)&reply, sizeof(reply));
+  udp.endPacket();
+}
+
+/*
+ * Apply command to outputs
+ */
+uint8_t UdpControl::execute(udpControlRequest *request) {
+  if (request->command == udpCommandState) {
+    return udpStatusOk;
+  }
+  if (request->index >= device->getOutputCount()) {
+    return udpStatusIndex;
+  }
+  switch (request->command) {
+    case udpCommandSet:
+      device->setOutputState(request->index, request->state);
+    break;
+    case udpCommandToggle:
+      device->setOutputState(request->index, !device->getOutputState(request->index));
+    break;
+    default:
+      return udpStatusCommand;
+  }
+  return udpStatusOk;
+}
+
+/*
+ * Truncated HMAC-SHA256 with shared key
+ */
+void UdpControl::sign(const void *data, size_t length, uint8_t *mac) {
+  br_hmac_context context;
+  br_hmac_init(&context, &key, UDP_CONTROL_MAC_SIZE);
+  br_hmac_update(&context, data, length);
+  br_hmac_out(&context, mac);
+}
+
+uint32_t UdpControl::getAccepted() {
+  return accepted;
+}
+
+uint32_t UdpControl::getRejected() {
+  return rejected;
+}
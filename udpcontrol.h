@@ -0,0 +1,99 @@
+/*
+This file is part of sonny Copyright (C) 2017 Erik de Jong
+
+sonny is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+sonny is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with sonny.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UDPCONTROL_H
+#define UDPCONTROL_H
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+// https://bearssl.org/apidoc/bearssl__hmac_8h.html
+#include <bearssl/bearssl.h>
+
+#include "sonny.h"
+
+#define UDP_CONTROL_MAGIC       0x53        // 'S'
+#define UDP_CONTROL_MAC_SIZE    16          // Truncated HMAC-SHA256
+#define UDP_CONTROL_REPLY       0x80        // Set in command of reply
+
+typedef enum {
+  udpCommandState = 0,                      // Only report states
+  udpCommandSet,                            // Set output to state
+  udpCommandToggle                          // Invert state of output
+} udpControlCommand;
+
+typedef enum {
+  udpStatusOk = 0,
+  udpStatusIndex,                           // No such output
+  udpStatusCommand,                         // Unknown command
+  udpStatusNonce,                           // Nonce not of this boot, reply carries the current one
+  udpStatusReplay                           // Sequence not above last accepted, reply carries that one
+} udpControlStatus;
+
+/*
+ * Datagram to device, little endian, MAC over all bytes before it
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t                   magic;                                // UDP_CONTROL_MAGIC
+  uint8_t                   command;                              // udpControlCommand
+  uint8_t                   index;                                // Output index as in MQTT topics
+  uint8_t                   state;                                // Requested state as published, so after reportInverted
+  uint32_t                  nonce;                                // Nonce of current boot, from any reply
+  uint32_t                  sequence;                             // Above last accepted, from any reply
+  uint8_t                   mac[UDP_CONTROL_MAC_SIZE];
+} udpControlRequest;
+
+/*
+ * Datagram from device
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t                   magic;                                // UDP_CONTROL_MAGIC
+  uint8_t                   command;                              // Command of request | UDP_CONTROL_REPLY
+  uint8_t                   status;                               // udpControlStatus
+  uint8_t                   outputCount;                          // Amount of outputs
+  uint32_t                  states;                               // Bit per output, state as published
+  uint32_t                  nonce;                                // Nonce of current boot
+  uint32_t                  sequence;                             // Sequence of request
+  uint32_t                  accepted;                             // Last accepted sequence of current boot
+  uint8_t                   mac[UDP_CONTROL_MAC_SIZE];
+} udpControlReply;
+
+/*
+ * Switches outputs on authenticated datagrams without a broker round trip, changes are published by handleIO() as usual
+ */
+class UdpControl {
+public:
+  UdpControl(Sonny *device, const char *key, uint16_t port);
+  void begin();
+  bool ready();
+  void handle();
+  uint32_t getAccepted();
+  uint32_t getRejected();
+private:
+  void sign(const void *data, size_t length, uint8_t *mac);
+  uint8_t execute(udpControlRequest *request);
+  WiFiUDP                   udp;
+  Sonny                     *device;
+  br_hmac_key_context       key;                                  // Prepared HMAC key
+  uint16_t                  port;
+  int                       packetSize = 0;                       // Size of datagram found by ready()
+  uint32_t                  nonce;                                // Random per boot, so old datagrams can't be replayed after a reset
+  uint32_t                  sequence = 0;                         // Last accepted sequence
+  uint32_t                  accepted = 0;                         // Executed requests
+  uint32_t                  rejected = 0;                         // Malformed or unauthenticated datagrams
+};
+
+#endif // UDPCONTROL_H